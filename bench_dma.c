@@ -0,0 +1,574 @@
+/*
+ * bench_dma.c - mydma驱动的吞吐/延迟基准测试
+ * 按负载大小、队列深度和线程数扫描各种提交模式，输出ops/s、GB/s和p50/p99/p999延迟，
+ * 可以输出CSV或JSON Lines，便于在版本之间比较性能回归。用法: ./bench_dma -h
+ *
+ * 每个线程各自打开一次设备，驱动按打开时所在的CPU为它选择硬件队列。模式:
+ *   rw     write()/read()拷贝路径，每轮先写depth次再读depth次
+ *   batch  零拷贝缓冲区，每轮一次MYDMA_IOC_SUBMIT_BATCH提交depth个，再逐个MYDMA_IOC_COMPLETE
+ *   uring  共享内存提交/完成队列，每轮填depth个SQE，一次URING_ENTER提交并等待全部CQE
+ *   poll   同rw，但打开MYDMA_OPT_POLL_USECS混合轮询
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include "mydma_ioctl.h"
+
+#define DEVICE_PATH     "/dev/mydma0"
+#define MAX_LIST        32
+#define MAX_SAMPLES     (1u << 20) // 每个线程最多记录的延迟样本数，超出后只计数不采样
+
+enum bench_mode { MODE_RW, MODE_BATCH, MODE_URING, MODE_POLL, NR_MODES };
+static const char *const mode_names[NR_MODES] = { "rw", "batch", "uring", "poll" };
+
+enum out_fmt { FMT_TEXT, FMT_CSV, FMT_JSON };
+
+// 命令行配置
+static struct {
+    const char *path;
+    int modes[NR_MODES];
+    int nr_modes;
+    unsigned int min_size, max_size;
+    unsigned int depths[MAX_LIST];
+    int nr_depths;
+    unsigned int threads[MAX_LIST];
+    int nr_threads;
+    unsigned int duration_ms;
+    unsigned int poll_usecs;
+    int verify;
+    enum out_fmt fmt;
+} cfg = {
+    .path = DEVICE_PATH,
+    .min_size = 64,
+    .duration_ms = 1000,
+    .poll_usecs = 50,
+    .fmt = FMT_TEXT,
+};
+
+// 一个测试点: 模式 x 负载大小 x 队列深度 x 线程数
+struct bench_point {
+    int mode;
+    unsigned int size;
+    unsigned int depth;
+    unsigned int nr_threads;
+    pthread_barrier_t start;
+};
+
+// 每个线程的结果
+struct bench_thread {
+    pthread_t tid;
+    struct bench_point *pt;
+    uint64_t ops;
+    uint64_t errors;
+    uint64_t elapsed_ns;
+    uint32_t *samples;      // 单次操作延迟(ns)
+    uint32_t nr_samples;
+    int err;                // 初始化失败时的errno
+};
+
+static struct mydma_pool_info pool;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void record(struct bench_thread *t, uint64_t lat)
+{
+    t->ops++;
+    if (t->nr_samples < MAX_SAMPLES)
+        t->samples[t->nr_samples++] = lat > UINT32_MAX ? UINT32_MAX : (uint32_t)lat;
+}
+
+// 初始化完成后等所有线程就绪再同时开始计时，返回本线程的结束时间
+static uint64_t start_run(struct bench_thread *t)
+{
+    pthread_barrier_wait(&t->pt->start);
+    t->elapsed_ns = now_ns();
+    return t->elapsed_ns + (uint64_t)cfg.duration_ms * 1000000ull;
+}
+
+static void fill_pattern(unsigned char *p, unsigned int len, unsigned int seed)
+{
+    unsigned int i;
+
+    for (i = 0; i < len; i++)
+        p[i] = (unsigned char)(i * 31 + seed);
+}
+
+// --- rw / poll 模式 ---
+static void run_rw(struct bench_thread *t, int fd)
+{
+    struct bench_point *pt = t->pt;
+    unsigned char *wbuf = malloc(pt->size), *rbuf = malloc(pt->size);
+    uint64_t *t0 = calloc(pt->depth, sizeof(*t0));
+    unsigned int i;
+    uint64_t end;
+    ssize_t n;
+
+    if (!wbuf || !rbuf || !t0) { t->err = ENOMEM; goto out; }
+    fill_pattern(wbuf, pt->size, 0);
+
+    if (pt->mode == MODE_POLL) {
+        struct mydma_opt opt = { .opt = MYDMA_OPT_POLL_USECS, .val = cfg.poll_usecs };
+
+        if (ioctl(fd, MYDMA_IOC_SET_OPT, &opt) < 0) { t->err = errno; goto out; }
+    }
+
+    end = start_run(t);
+    while (now_ns() < end) {
+        for (i = 0; i < pt->depth; i++) {
+            t0[i] = now_ns();
+            if (write(fd, wbuf, pt->size) != (ssize_t)pt->size) { t->errors++; t0[i] = 0; }
+        }
+        // 同一队列上write()提交的传输按完成顺序进入FIFO，与提交顺序一致
+        for (i = 0; i < pt->depth; i++) {
+            if (!t0[i]) continue;
+            n = read(fd, rbuf, pt->size);
+            if (n != (ssize_t)pt->size || (cfg.verify && memcmp(wbuf, rbuf, pt->size))) { t->errors++; continue; }
+            record(t, now_ns() - t0[i]);
+        }
+    }
+    t->elapsed_ns = now_ns() - t->elapsed_ns;
+out:
+    free(wbuf);
+    free(rbuf);
+    free(t0);
+    if (t->err) pthread_barrier_wait(&pt->start);
+}
+
+// 申请depth个零拷贝缓冲区并逐个映射，失败时返回-1并设置t->err。
+// 驱动只允许映射本文件的缓冲区：先占住与缓冲池一样大的地址范围，再把每个缓冲区按池内偏移映射进来，
+// 仍以map + buf * buf_size访问
+static int pool_setup(struct bench_thread *t, int fd, uint32_t *bufs, unsigned char **map)
+{
+    struct bench_point *pt = t->pt;
+    unsigned int i;
+    size_t off;
+
+    *map = mmap(NULL, (size_t)pool.nr_bufs * pool.buf_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (*map == MAP_FAILED) { *map = NULL; t->err = errno; return -1; }
+
+    for (i = 0; i < pt->depth; i++) {
+        // 缓冲池按队列划分，深度超过分片大小时BUF_ALLOC返回EBUSY
+        if (ioctl(fd, MYDMA_IOC_BUF_ALLOC, &bufs[i]) < 0) { t->err = errno; return -1; }
+        off = (size_t)bufs[i] * pool.buf_size;
+        if (mmap(*map + off, pool.buf_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, off) == MAP_FAILED) {
+            t->err = errno;
+            return -1;
+        }
+        fill_pattern(*map + off, pt->size, i);
+    }
+    return 0;
+}
+
+static int verify_buf(const unsigned char *map, uint32_t buf, unsigned int len, unsigned int seed)
+{
+    const unsigned char *p = map + (size_t)buf * pool.buf_size;
+    unsigned int i;
+
+    for (i = 0; i < len; i++)
+        if (p[i] != (unsigned char)(i * 31 + seed)) return -1;
+    return 0;
+}
+
+// --- batch 模式 ---
+static void run_batch(struct bench_thread *t, int fd)
+{
+    struct bench_point *pt = t->pt;
+    uint32_t *bufs = calloc(pt->depth, sizeof(*bufs));
+    struct mydma_buf_req *reqs = calloc(pt->depth, sizeof(*reqs));
+    struct mydma_buf_batch batch;
+    struct mydma_buf_req req;
+    unsigned char *map = NULL;
+    unsigned int i, done;
+    uint64_t t0, end;
+    int n;
+
+    if (!bufs || !reqs) { t->err = ENOMEM; goto out; }
+    if (pool_setup(t, fd, bufs, &map)) goto out;
+
+    end = start_run(t);
+    while (now_ns() < end) {
+        t0 = now_ns();
+        // 环形缓冲区放不下时驱动只入队一部分，剩下的再提交一次
+        for (done = 0; done < pt->depth; done += n) {
+            for (i = 0; i < pt->depth - done; i++) {
+                reqs[i].buf = bufs[done + i];
+                reqs[i].len = pt->size;
+            }
+            batch.reqs = (uintptr_t)reqs;
+            batch.nr = pt->depth - done;
+            batch.resv = 0;
+            n = ioctl(fd, MYDMA_IOC_SUBMIT_BATCH, &batch);
+            if (n <= 0) break;
+        }
+        for (i = 0; i < done; i++) {
+            req.buf = bufs[i];
+            req.len = 0;
+            if (ioctl(fd, MYDMA_IOC_COMPLETE, &req) < 0 || req.len != pt->size ||
+                (cfg.verify && verify_buf(map, bufs[i], pt->size, i))) { t->errors++; continue; }
+            record(t, now_ns() - t0);
+        }
+        t->errors += pt->depth - done;
+    }
+    t->elapsed_ns = now_ns() - t->elapsed_ns;
+out:
+    if (map) munmap(map, (size_t)pool.nr_bufs * pool.buf_size);
+    free(bufs);
+    free(reqs);
+    if (t->err) pthread_barrier_wait(&pt->start);
+}
+
+// --- uring 模式 ---
+#define RING_U32(base, off) ((uint32_t *)((unsigned char *)(base) + (off)))
+
+static void run_uring(struct bench_thread *t, int fd)
+{
+    struct bench_point *pt = t->pt;
+    struct mydma_uring_params p = { .sq_entries = pt->depth };
+    uint32_t *bufs = calloc(pt->depth, sizeof(*bufs));
+    uint32_t *sq_head, *sq_tail, *cq_head, *cq_tail;
+    struct mydma_uring_enter e;
+    struct mydma_sqe *sqes;
+    struct mydma_cqe *cqes, *cqe;
+    unsigned char *map = NULL;
+    void *region = NULL;
+    uint32_t tail, head, got;
+    unsigned int i;
+    uint64_t t0, end;
+
+    if (!bufs) { t->err = ENOMEM; goto out; }
+    if (pool_setup(t, fd, bufs, &map)) goto out;
+    if (ioctl(fd, MYDMA_IOC_URING_SETUP, &p) < 0) { t->err = errno; goto out; }
+    region = mmap(NULL, p.region_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, MYDMA_MMAP_OFF_URING);
+    if (region == MAP_FAILED) { region = NULL; t->err = errno; goto out; }
+
+    sq_head = RING_U32(region, p.sq_head_off);
+    sq_tail = RING_U32(region, p.sq_tail_off);
+    cq_head = RING_U32(region, p.cq_head_off);
+    cq_tail = RING_U32(region, p.cq_tail_off);
+    sqes = (struct mydma_sqe *)((unsigned char *)region + p.sqes_off);
+    cqes = (struct mydma_cqe *)((unsigned char *)region + p.cqes_off);
+
+    end = start_run(t);
+    while (now_ns() < end) {
+        t0 = now_ns();
+        tail = *sq_tail;
+        for (i = 0; i < pt->depth; i++, tail++) {
+            struct mydma_sqe *sqe = &sqes[tail & (p.sq_entries - 1)];
+
+            sqe->buf = bufs[i];
+            sqe->len = pt->size;
+            sqe->user_data = i;
+        }
+        __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+
+        // 硬件队列满时SQE留在SQ中，继续敲门铃直到全部被消费；最后一次同时等待全部完成
+        for (got = 0; got < pt->depth;) {
+            e.to_submit = tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+            e.min_complete = e.to_submit ? 0 : pt->depth - got;
+            if (ioctl(fd, MYDMA_IOC_URING_ENTER, &e) < 0 && errno != EINTR) { t->errors++; break; }
+
+            head = *cq_head;
+            while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+                cqe = &cqes[head & (p.cq_entries - 1)];
+                if (cqe->res || cqe->len != pt->size ||
+                    (cfg.verify && verify_buf(map, cqe->buf, pt->size, (unsigned int)cqe->user_data))) t->errors++;
+                else record(t, now_ns() - t0);
+                head++;
+                got++;
+            }
+            __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+        }
+    }
+    t->elapsed_ns = now_ns() - t->elapsed_ns;
+out:
+    if (region) munmap(region, p.region_size);
+    if (map) munmap(map, (size_t)pool.nr_bufs * pool.buf_size);
+    free(bufs);
+    if (t->err) pthread_barrier_wait(&pt->start);
+}
+
+static void *bench_thread_fn(void *arg)
+{
+    struct bench_thread *t = arg;
+    struct bench_point *pt = t->pt;
+    int fd;
+
+    fd = open(cfg.path, O_RDWR);
+    if (fd < 0) {
+        t->err = errno;
+        pthread_barrier_wait(&pt->start);
+        return NULL;
+    }
+
+    switch (pt->mode) {
+    case MODE_RW:
+    case MODE_POLL:
+        run_rw(t, fd);
+        break;
+    case MODE_BATCH:
+        run_batch(t, fd);
+        break;
+    case MODE_URING:
+        run_uring(t, fd);
+        break;
+    }
+    close(fd);
+    return NULL;
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static double percentile_us(const uint32_t *s, uint64_t n, double pct)
+{
+    uint64_t idx;
+
+    if (!n) return 0;
+    idx = (uint64_t)(pct / 100.0 * (n - 1) + 0.5);
+    return s[idx] / 1000.0;
+}
+
+static void print_header(void)
+{
+    switch (cfg.fmt) {
+    case FMT_TEXT:
+        printf("%-6s %8s %6s %7s %12s %10s %10s %10s %10s %8s\n",
+               "mode", "size", "depth", "threads", "ops/s", "GB/s", "p50(us)", "p99(us)", "p999(us)", "errors");
+        break;
+    case FMT_CSV:
+        printf("mode,size,depth,threads,ops,secs,ops_per_sec,gb_per_sec,p50_us,p99_us,p999_us,errors\n");
+        break;
+    case FMT_JSON:
+        break;
+    }
+}
+
+// 运行一个测试点并输出一行结果；初始化失败时返回负的errno
+static int run_point(int mode, unsigned int size, unsigned int depth, unsigned int nr_threads)
+{
+    struct bench_point pt = { .mode = mode, .size = size, .depth = depth, .nr_threads = nr_threads };
+    struct bench_thread *ts = calloc(nr_threads, sizeof(*ts));
+    uint64_t ops = 0, errors = 0, elapsed = 0, nr = 0;
+    double secs, p50, p99, p999;
+    uint32_t *all = NULL;
+    unsigned int i;
+    int err = 0;
+
+    if (!ts) return -ENOMEM;
+    pthread_barrier_init(&pt.start, NULL, nr_threads);
+    for (i = 0; i < nr_threads; i++) {
+        ts[i].pt = &pt;
+        ts[i].samples = malloc(MAX_SAMPLES * sizeof(uint32_t));
+        if (!ts[i].samples) { fprintf(stderr, "Out of memory\n"); exit(EXIT_FAILURE); }
+        pthread_create(&ts[i].tid, NULL, bench_thread_fn, &ts[i]);
+    }
+    for (i = 0; i < nr_threads; i++) {
+        pthread_join(ts[i].tid, NULL);
+        if (ts[i].err && !err) err = ts[i].err;
+        ops += ts[i].ops;
+        errors += ts[i].errors;
+        nr += ts[i].nr_samples;
+        if (ts[i].elapsed_ns > elapsed) elapsed = ts[i].elapsed_ns;
+    }
+    pthread_barrier_destroy(&pt.start);
+    if (err) goto out;
+
+    // 合并所有线程的样本再求百分位
+    all = malloc((nr ? nr : 1) * sizeof(uint32_t));
+    if (!all) { err = ENOMEM; goto out; }
+    for (nr = 0, i = 0; i < nr_threads; i++) {
+        memcpy(all + nr, ts[i].samples, ts[i].nr_samples * sizeof(uint32_t));
+        nr += ts[i].nr_samples;
+    }
+    qsort(all, nr, sizeof(uint32_t), cmp_u32);
+    p50 = percentile_us(all, nr, 50);
+    p99 = percentile_us(all, nr, 99);
+    p999 = percentile_us(all, nr, 99.9);
+    secs = elapsed ? elapsed / 1e9 : 1;
+
+    switch (cfg.fmt) {
+    case FMT_TEXT:
+        printf("%-6s %8u %6u %7u %12.0f %10.3f %10.2f %10.2f %10.2f %8llu\n",
+               mode_names[mode], size, depth, nr_threads, ops / secs, ops * (double)size / secs / 1e9,
+               p50, p99, p999, (unsigned long long)errors);
+        break;
+    case FMT_CSV:
+        printf("%s,%u,%u,%u,%llu,%.6f,%.1f,%.6f,%.3f,%.3f,%.3f,%llu\n",
+               mode_names[mode], size, depth, nr_threads, (unsigned long long)ops, secs, ops / secs,
+               ops * (double)size / secs / 1e9, p50, p99, p999, (unsigned long long)errors);
+        break;
+    case FMT_JSON:
+        printf("{\"mode\":\"%s\",\"size\":%u,\"depth\":%u,\"threads\":%u,\"ops\":%llu,\"secs\":%.6f,"
+               "\"ops_per_sec\":%.1f,\"gb_per_sec\":%.6f,\"p50_us\":%.3f,\"p99_us\":%.3f,\"p999_us\":%.3f,"
+               "\"errors\":%llu}\n",
+               mode_names[mode], size, depth, nr_threads, (unsigned long long)ops, secs, ops / secs,
+               ops * (double)size / secs / 1e9, p50, p99, p999, (unsigned long long)errors);
+        break;
+    }
+    fflush(stdout);
+
+out:
+    for (i = 0; i < nr_threads; i++)
+        free(ts[i].samples);
+    free(ts);
+    free(all);
+    return -err;
+}
+
+// 解析逗号分隔的正整数列表
+static int parse_list(const char *s, unsigned int *out, int max)
+{
+    char *dup = strdup(s), *tok, *save = NULL;
+    int n = 0;
+
+    for (tok = strtok_r(dup, ",", &save); tok && n < max; tok = strtok_r(NULL, ",", &save)) {
+        out[n] = strtoul(tok, NULL, 0);
+        if (!out[n]) { free(dup); return -1; }
+        n++;
+    }
+    free(dup);
+    return n;
+}
+
+// 从/sys/class/mydma/mydmaN/max_transfer读取单次write()的上限，读不到时返回0
+static unsigned int read_max_transfer(const char *path)
+{
+    const char *name = strrchr(path, '/');
+    unsigned int val = 0;
+    char sys[256];
+    FILE *f;
+
+    snprintf(sys, sizeof(sys), "/sys/class/mydma/%s/max_transfer", name ? name + 1 : path);
+    f = fopen(sys, "r");
+    if (!f) return 0;
+    if (fscanf(f, "%u", &val) != 1) val = 0;
+    fclose(f);
+    return val;
+}
+
+static int parse_modes(const char *s)
+{
+    char *dup = strdup(s), *tok, *save = NULL;
+    int m;
+
+    cfg.nr_modes = 0;
+    for (tok = strtok_r(dup, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        for (m = 0; m < NR_MODES; m++)
+            if (!strcmp(tok, mode_names[m])) break;
+        if (m == NR_MODES || cfg.nr_modes == NR_MODES) { free(dup); return -1; }
+        cfg.modes[cfg.nr_modes++] = m;
+    }
+    free(dup);
+    return cfg.nr_modes ? 0 : -1;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -d PATH    device node (default %s)\n"
+            "  -m LIST    modes: rw,batch,uring,poll (default all)\n"
+            "  -s BYTES   smallest payload, doubled up to -S (default 64)\n"
+            "  -S BYTES   largest payload (default: driver max_transfer; batch/uring stop at buffer size)\n"
+            "  -q LIST    queue depths (default 1,8,32)\n"
+            "  -t LIST    thread counts (default 1)\n"
+            "  -T MS      run time per point in milliseconds (default 1000)\n"
+            "  -P USECS   busy-poll budget for poll mode (default 50)\n"
+            "  -c         verify data after every transfer\n"
+            "  -o FMT     output: text, csv or json (JSON Lines) (default text)\n",
+            prog, DEVICE_PATH);
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned int size;
+    int opt, fd, m, q, t, ret, failed = 0;
+
+    cfg.nr_modes = NR_MODES;
+    for (m = 0; m < NR_MODES; m++)
+        cfg.modes[m] = m;
+    cfg.depths[0] = 1;
+    cfg.depths[1] = 8;
+    cfg.depths[2] = 32;
+    cfg.nr_depths = 3;
+    cfg.threads[0] = 1;
+    cfg.nr_threads = 1;
+
+    while ((opt = getopt(argc, argv, "d:m:s:S:q:t:T:P:co:h")) != -1) {
+        switch (opt) {
+        case 'd': cfg.path = optarg; break;
+        case 'm': if (parse_modes(optarg)) { usage(argv[0]); return EXIT_FAILURE; } break;
+        case 's': cfg.min_size = strtoul(optarg, NULL, 0); break;
+        case 'S': cfg.max_size = strtoul(optarg, NULL, 0); break;
+        case 'q': cfg.nr_depths = parse_list(optarg, cfg.depths, MAX_LIST); break;
+        case 't': cfg.nr_threads = parse_list(optarg, cfg.threads, MAX_LIST); break;
+        case 'T': cfg.duration_ms = strtoul(optarg, NULL, 0); break;
+        case 'P': cfg.poll_usecs = strtoul(optarg, NULL, 0); break;
+        case 'c': cfg.verify = 1; break;
+        case 'o':
+            if (!strcmp(optarg, "text")) cfg.fmt = FMT_TEXT;
+            else if (!strcmp(optarg, "csv")) cfg.fmt = FMT_CSV;
+            else if (!strcmp(optarg, "json")) cfg.fmt = FMT_JSON;
+            else { usage(argv[0]); return EXIT_FAILURE; }
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    if (cfg.nr_depths <= 0 || cfg.nr_threads <= 0 || !cfg.min_size || !cfg.duration_ms) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    fd = open(cfg.path, O_RDWR);
+    if (fd < 0) { perror("Failed to open device"); return EXIT_FAILURE; }
+    if (ioctl(fd, MYDMA_IOC_POOL_INFO, &pool) < 0) { perror("MYDMA_IOC_POOL_INFO"); close(fd); return EXIT_FAILURE; }
+    close(fd);
+    // 默认扫到驱动允许的最大传输，覆盖rw/poll的多描述符串联路径；读不到时退回一个缓冲区
+    if (!cfg.max_size) cfg.max_size = read_max_transfer(cfg.path);
+    if (!cfg.max_size) cfg.max_size = pool.buf_size;
+
+    print_header();
+    for (m = 0; m < cfg.nr_modes; m++) {
+        // 负载大小从min_size起逐次翻倍，最后一个点取max_size
+        for (size = cfg.min_size; size <= cfg.max_size; size = size * 2 < cfg.max_size ? size * 2 : cfg.max_size) {
+            // 零拷贝模式的负载不能超过一个缓冲区
+            if ((cfg.modes[m] == MODE_BATCH || cfg.modes[m] == MODE_URING) && size > pool.buf_size) break;
+            for (q = 0; q < cfg.nr_depths; q++) {
+                for (t = 0; t < cfg.nr_threads; t++) {
+                    ret = run_point(cfg.modes[m], size, cfg.depths[q], cfg.threads[t]);
+                    if (ret) {
+                        fprintf(stderr, "%s size=%u depth=%u threads=%u: %s\n", mode_names[cfg.modes[m]],
+                                size, cfg.depths[q], cfg.threads[t], strerror(-ret));
+                        failed = 1;
+                    }
+                }
+            }
+            if (size == cfg.max_size) break;
+        }
+    }
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -19,11 +19,55 @@
 #include <linux/compiler.h>
 #include <linux/interrupt.h>
 #include <linux/sched.h>
+#include <linux/sched/signal.h>
+#include <linux/spinlock.h>
+#include <linux/bitops.h>
+#include <linux/bitmap.h>
+#include <linux/moduleparam.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/log2.h>
+#include <linux/uio.h>
+#include <linux/string.h>
+#include <linux/sizes.h>
+#include <linux/scatterlist.h>
+#include <linux/list.h>
+#include <linux/atomic.h>
+#include <linux/cpumask.h>
+#include <linux/poll.h>
+#include <linux/ktime.h>
+#include <linux/percpu.h>
+#include <linux/sysfs.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/mutex.h>
+#include <linux/idr.h>
+#include <linux/platform_device.h>
+#include <linux/pm_runtime.h>
+#include <linux/kthread.h>
+#include <linux/irq.h>
+#include <linux/irqdomain.h>
+#include <linux/irq_sim.h>
+#include <linux/dma-direct.h>
+#include <linux/math64.h>
+#include <linux/dma-buf.h>
+#include <linux/dma-resv.h>
+#include <linux/workqueue.h>
+#include <linux/delay.h>
+#include <linux/crc32c.h>
+#include <linux/kref.h>
+#include <linux/srcu.h>
+
+#include "mydma_ioctl.h"
+
+#define CREATE_TRACE_POINTS
+#include "mydma_trace.h"
 
 // --- 1. 宏定义 ---
 
 #define DRIVER_NAME "mydma"
 #define DEVICE_NAME "mydma"
+#define MYDMA_MAX_DEVICES 64 // 每块卡占用一个次设备号
 #define MYDMA_VENDOR_ID 0x1234
 #define MYDMA_DEVICE_ID 0x5678
 
@@ -35,8 +79,50 @@
 #define MYDMA_REG_RING_SIZE     0x20
 #define MYDMA_REG_QUEUE_HEAD    0x28
 #define MYDMA_REG_QUEUE_TAIL    0x30
+#define MYDMA_REG_DEV_CAPS      0x38 // 只读，设备能力位，见MYDMA_CAP_*
+#define MYDMA_REG_INT_COAL_COUNT 0x40 // 累计完成多少个描述符后才产生一次中断 (0/1表示不合并)
+#define MYDMA_REG_INT_COAL_USECS 0x48 // 有未通知的完成时，最多延迟多少微秒产生中断
+#define MYDMA_REG_NUM_QUEUES    0x50 // 只读，设备支持的队列数 (0表示只有一个队列)
+#define MYDMA_REG_DESC_FORMAT   0x58 // 描述符格式，见MYDMA_DESC_FMT_*，复位后为原有的32字节格式
+#define MYDMA_REG_WC_QUEUE_STRIDE 0x60 // 只读，BAR2中相邻队列描述符窗口的间距 (0表示没有写合并窗口)
+#define MYDMA_REG_QUEUE_ARB     0x68 // 该队列取描述符的仲裁设置，见MYDMA_ARB_*，复位后为权重1、不严格优先
+
+// 多队列：队列N的INT_ENABLE/RING_*/QUEUE_*寄存器位于 N * MYDMA_QUEUE_REG_STRIDE + 上述偏移处，
+// 队列0与原有的单队列寄存器布局重合；其余寄存器(复位、能力、中断合并)只存在于队列0的寄存器组中
+#define MYDMA_QUEUE_REG_STRIDE  0x100
+
+#define MYDMA_CAP_INT_COAL      BIT(0) // 支持硬件中断合并寄存器
+#define MYDMA_CAP_DESC64        BIT(1) // 支持64字节、带相位位的描述符格式
+#define MYDMA_CAP_INLINE        BIT(2) // 64字节格式支持内联数据的描述符(MYDMA_DESC_F_INLINE)
+#define MYDMA_CAP_QUEUE_ARB     BIT(3) // 队列之间按MYDMA_REG_QUEUE_ARB仲裁，不支持时各队列平等轮询
+#define MYDMA_CAP_CRC32C        BIT(4) // 64字节格式下带MYDMA_DESC_F_CRC的描述符完成时回写输出数据的CRC32C
 
-#define MAX_DMA_TRANSFER_SIZE PAGE_SIZE // 为简化起见，限制单次DMA传输最大为一页
+#define MYDMA_ARB_WEIGHT_MASK   0xff   // 加权轮询中该队列每轮最多取的描述符数
+#define MYDMA_ARB_STRICT        BIT(31) // 严格优先：该队列有待取的描述符时总是先于其他队列
+
+#define MYDMA_DESC_FMT_64       BIT(0) // 使用struct mydma_desc64
+#define MYDMA_DESC_FMT_WC       BIT(1) // 从BAR2的写合并窗口取描述符，status仍回写到主机内存的环形缓冲区
+#define MYDMA_WC_BAR            2
+
+#define MYDMA_RING_MIN_SIZE   8       // 环形缓冲区深度的范围，须为2的幂；设备能接受的上限由MYDMA_REG_RING_SIZE回读确认
+#define MYDMA_RING_MAX_SIZE   65536
+#define MYDMA_POOL_BUF_SIZE   PAGE_SIZE // 缓冲池中每个缓冲区的大小，更大的传输占用多个相邻缓冲区
+#define MYDMA_DESC_MAX_LEN    SZ_32K    // 单个描述符的最大长度 (in_len/out_len只有16位)
+#define MYDMA_WAIT_TIMEOUT_MS 5000 // 还没有测得吞吐量时等待DMA完成的超时时间，也是自适应超时的上限
+#define MYDMA_TIMEOUT_MIN_MS  20   // 自适应超时的下限，包含中断和调度的延迟
+#define MYDMA_TIMEOUT_MAX_MS  600000 // MYDMA_OPT_TIMEOUT_MS的上限
+#define MYDMA_TIMEOUT_SLACK   4    // 自适应超时为按测得吞吐量推算的传输时间的这么多倍
+#define MYDMA_RESET_QUIESCE_MS 100 // 看门狗复位设备前最多等待这么久，让已保留槽位的提交者填好描述符
+#define MYDMA_PM_IDLE_MS      10   // 队列没有提交者也没有在途描述符这么久之后，释放它持有的设备运行时电源管理引用
+#define MYDMA_URING_MAX_ENTRIES 4096 // 共享提交队列的最大深度
+#define MYDMA_WRITEV_BATCH    32   // writev()每批最多填充的描述符数
+#define MYDMA_INLINE_MAX      28   // 内联描述符最多携带的数据字节数，即64字节格式中的保留区
+#define MYDMA_IRQ_BUDGET      64   // 中断线程每轮最多回收的描述符数
+#define MYDMA_REAP_SCAN       64   // 队列头未完成时，回收路径最多越过多少个在途描述符去找乱序完成的描述符
+#define MYDMA_POLL_MAX_USECS  10000 // MYDMA_OPT_POLL_USECS的上限
+#define MYDMA_LAT_BUCKETS     32   // 延迟直方图的桶数，第N个桶统计[2^N, 2^(N+1))纳秒，最后一个桶包含更大的值
+#define MYDMA_MOCK_WINDOW     64   // 模拟设备每个队列最多预取的描述符数，须为2的幂
+#define MYDMA_MOCK_SPIN_NS    20000 // 模拟设备离下一个完成时刻不到这么久时忙等，睡眠定时器的精度不够
 
 // --- 2. 数据结构定义 ---
 
@@ -45,46 +131,361 @@ struct dma_descriptor {
     volatile u32 done;      // 完成标志位。0xFF00: 待处理, 0: 硬件处理完毕
     u32        in_len: 16,  // 输入数据长度 (字节)
                out_len: 16; // 输出缓冲区最大长度 (字节)
-    u32        reserved1;   // 保留字段
+    u32        flags;       // 描述符标志 (原reserved1字段)，见MYDMA_DESC_F_*
     u32        reserved2;   // 保留字段
     dma_addr_t in_addr;     // 输入数据的DMA物理地址
     dma_addr_t out_addr;    // 输出缓冲区的DMA物理地址
 };
 
-// 驱动侧用于跟踪在途DMA操作的上下文
-struct dma_context {
+// 64字节描述符格式 (MYDMA_CAP_DESC64)：正好占一个缓存行，驱动填写的字段在前，一次连续写出；
+// 硬件回写的status单独放在行尾，驱动从不写它。是否完成看status中的相位位，提交前不需要复位
+struct mydma_desc64 {
+    u64          in_addr;
+    u64          out_addr;
+    u32          in_len;
+    u32          out_len;
+    u32          flags;         // MYDMA_DESC_F_*，含本轮的MYDMA_DESC_F_PHASE
+    u8           inline_data[MYDMA_INLINE_MAX]; // 带MYDMA_DESC_F_INLINE时的数据，设备把结果写回这里
+    volatile u32 status;        // MYDMA_DESC_ST_*，由硬件写
+    volatile u32 crc;           // 带MYDMA_DESC_F_CRC时设备写出的数据的CRC32C(初值~0，不取反)，在status之前写
+} __aligned(64);
+
+#define MYDMA_DESC64_SW_BYTES offsetof(struct mydma_desc64, status) // 驱动写入的部分，8字节的整数倍
+
+// 缓冲池中缓冲区的状态
+enum mydma_buf_state {
+    MYDMA_BUF_FREE = 0,  // 空闲，未被任何人持有
+    MYDMA_BUF_OWNED,     // 已被write()或零拷贝用户持有，尚未提交
+    MYDMA_BUF_INFLIGHT,  // 已提交给硬件
+    MYDMA_BUF_DONE,      // 硬件处理完毕，等待read()或MYDMA_IOC_COMPLETE取走
+};
+
+// 数据完整性校验 (MYDMA_OPT_CRC32C)：拷贝进缓冲池时已算出输入数据的CRC32C，
+// 完成时与设备回写的CRC比较(HW，只用于单个描述符的传输)，或在read()拷贝结果时由驱动计算后比较(SW)
+enum mydma_crc_check {
+    MYDMA_CRC_NONE = 0,
+    MYDMA_CRC_HW,
+    MYDMA_CRC_SW,
+};
+
+struct mydma_file;
+
+// 缓冲池中的一个缓冲区，dma_addr/virt_addr在probe时指向池内的固定位置
+// 大于MYDMA_POOL_BUF_SIZE的传输占用nr_bufs个相邻缓冲区，状态只记录在第一个缓冲区上
+struct mydma_buf {
     dma_addr_t dma_addr;
     void *virt_addr;
+    u32 nr_bufs;                // 占用的相邻缓冲区个数
+    u32 len;                    // 本次传输的字节数
+    u32 pending;                // 尚未完成的描述符个数
+    enum mydma_buf_state state; // 受ring_lock保护
+    struct mydma_file *owner;   // 零拷贝模式下持有该缓冲区的文件，NULL表示由write()/read()使用
+    struct mydma_file *file;    // 发起本次传输、接收其完成事件的文件；该文件关闭后为NULL
+    bool orphan;                // 持有者已关闭文件，完成后直接释放
+    bool uring;                 // 经共享提交队列提交，完成后投递CQE
+    bool direct;                // 直接模式的传输，外层为struct mydma_direct，不属于缓冲池
+    u64 user_data;              // SQE携带的用户数据，或带标签write()的标签，随完成事件返回
+    struct mydma_buf *src;      // 异地传输的输入缓冲区，完成时一并释放；就地传输为NULL
+    struct mydma_buf *dst;      // MYDMA_IOC_DMABUF_XFER的输出缓冲区，完成时一并释放
+    u32 exports;                // 导出的dma-buf个数，非0时不能归还缓冲池；受ring_lock保护
+    int res;                    // 传输结果，0表示成功；看门狗复位设备时被中止的传输为-EIO，随完成事件返回
+    u8 crc_check;               // enum mydma_crc_check
+    u32 crc;                    // 输入数据的CRC32C，crc_check非NONE时有效
+};
+
+// 为本设备导入的一个外部dma-buf：动态attach后pin住，映射在整个传输期间保持有效
+struct mydma_dmabuf_map {
+    struct dma_buf *dmabuf;
+    struct dma_buf_attachment *attach;
+    struct sg_table *sgt;
+};
+
+// 直接模式的一次传输：固定住的用户页及其流式DMA映射
+struct mydma_direct {
+    struct mydma_buf b;         // 复用缓冲区的完成跟踪字段，pending中含一个提交者自己的引用
+    struct page **pages;
+    int nr_pages;
+    struct sg_table sgt;
+    struct list_head orphan_node; // write()放弃等待后挂在priv_dev->direct_orphans上
+    struct mydma_dmabuf_map imp[2]; // MYDMA_IOC_DMABUF_XFER导入的输入、输出dma-buf，未导入的一端为空
+};
+
+// 导出的dma-buf的私有数据：缓冲池中的一个缓冲区
+struct mydma_dmabuf_export {
+    struct mydma_queue *q;
+    struct mydma_buf *b;
+};
+
+// 传输一端在DMA地址空间中的游标：缓冲区一端是一整段，dma-buf一端沿着它的sg表前进
+struct mydma_xfer_cursor {
+    struct scatterlist *sg;     // 缓冲区一端为NULL
+    dma_addr_t addr;
+    u32 left;                   // 当前连续段的剩余字节数
+};
+
+// 描述符标志：一次传输拆成多个描述符时，除最后一个外都带CHAIN，最后一个带LAST
+#define MYDMA_DESC_F_CHAIN  BIT(0)
+#define MYDMA_DESC_F_LAST   BIT(1)
+// 内联描述符：忽略in_addr/out_addr，数据就在inline_data中，设备在写status之前把结果写回inline_data
+#define MYDMA_DESC_F_INLINE BIT(2)
+// 64字节格式 (MYDMA_CAP_CRC32C)：设备边写输出数据边算CRC32C，写到描述符的crc字段中
+#define MYDMA_DESC_F_CRC    BIT(3)
+// 64字节格式：槽位每被复用一次相位翻转一次，硬件把它原样写回status；status中的相位与本轮一致才算完成
+#define MYDMA_DESC_F_PHASE  BIT(31)
+#define MYDMA_DESC_ST_DONE  BIT(0)
+#define MYDMA_DESC_ST_PHASE BIT(31)
+
+// 槽位状态：FREE表示空闲或已保留但尚未填好；READY表示描述符已填好，等待门铃按顺序发布给硬件；
+// INFLIGHT表示已发布，等待回收；DONE表示硬件乱序完成了它、完成事件已投递，但前面还有未完成的槽位。
+// 槽位总是按顺序回收，回收后重新置为FREE
+enum mydma_slot_state {
+    MYDMA_SLOT_FREE = 0,
+    MYDMA_SLOT_READY,
+    MYDMA_SLOT_INFLIGHT,
+    MYDMA_SLOT_DONE,
+};
+
+// res_tail中的标志位：置位后保留槽位的cmpxchg都会失败，看门狗复位设备期间用它挡住新的提交。
+// 槽位下标不超过MYDMA_RING_MAX_SIZE，用ring_mask截取下标时会去掉这一位
+#define MYDMA_RES_STOPPED   BIT(31)
+
+// 一个已完成的内联传输，回收时从描述符中拷贝出来，槽位随即可以复用
+struct mydma_inline_done {
+    u32 len;
+    s32 res;
+    u64 user_data;
+    u8 data[MYDMA_INLINE_MAX];
+};
+
+#define MYDMA_DONE_INLINE   U32_MAX // mydma_file.done_fifo中代表下一个内联传输结果的项
+
+// 驱动侧用于跟踪在途DMA操作的上下文，每个环形缓冲区槽位一个
+struct dma_context {
+    struct mydma_buf *buf;      // 该描述符使用的缓冲区，内联传输为NULL
+    struct mydma_file *file;    // 内联传输的发起文件，该文件关闭后为NULL
     size_t size;
+    u64 user_data;              // 内联传输的标签
+    u32 state;                  // enum mydma_slot_state，提交者、门铃和回收路径之间的交接点
+    u8 phase;                   // 64字节格式下该槽位本轮的相位
+    u64 submit_ns;              // 门铃写尾指针寄存器的时间，用于统计完成延迟
 };
 
-// 驱动的私有数据结构
-struct mydma_dev {
-    void __iomem *bar0_virt_addr;   // BAR0的内核虚拟地址
-    u32            ring_size;       // 环形缓冲区深度
-    struct pci_dev *pdev;           // 指向PCI设备的指针
-    int            irq;             // 中断号
+struct mydma_dev;
 
-    // 字符设备成员
-    struct cdev cdev;
-    dev_t dev_num;
-    struct class *dev_class;
-    struct device *device;
+// 一个硬件队列：独立的环形缓冲区、头尾寄存器、MSI-X向量和缓冲池分片，
+// 不同队列上的提交和完成互不共享锁与缓存行
+struct mydma_queue {
+    struct mydma_dev *priv_dev;
+    void __iomem *regs;             // 该队列寄存器组的起始地址
+    u32            qid;
+    u32            ring_size;       // 同mydma_dev::ring_size，热路径上少一次指针访问
+    u32            ring_mask;       // ring_size - 1，下标回绕用与运算代替取模
+    int            irq;             // 该队列的中断号
+    bool           desc64;          // 同mydma_dev::desc64
+    bool           hiprio;          // 保留给MYDMA_OPT_PRIORITY文件的高优先级队列
+    void __iomem  *wc_ring;         // 写合并描述符窗口，NULL表示描述符写入ring_buffer_virt_addr
 
-    // DMA描述符环形缓冲区
+    // DMA描述符环形缓冲区，一块连续的一致性内存，按页对齐，描述符不会跨缓存行
     dma_addr_t ring_buffer_dma_addr;
-    struct dma_descriptor *ring_buffer_virt_addr;
+    union {
+        struct dma_descriptor *ring_buffer_virt_addr;
+        struct mydma_desc64 *ring_desc64;           // desc64为true时
+    };
     size_t ring_buffer_size;
 
     // 软件上下文环形数组，用于跟踪DMA缓冲区
     struct dma_context *dma_ctx_ring;
 
-    // 驱动内部维护的队列头尾指针
+    // 该队列独占的缓冲池分片：pool_bufs[buf_base, buf_base + nr_bufs)
+    u32 buf_base;
+    u32 nr_bufs;
+    unsigned long *pool_bitmap;     // 置位表示缓冲区已被占用，以分片内的编号为下标
+
+    atomic_t inline_nr;             // 本队列上已提交、尚未被read()取走的内联传输个数，不超过nr_bufs
+
+    // 保护回收、各文件的完成FIFO、CQ投递和分片内缓冲区的状态；回收在中断线程中进行，硬中断不获取此锁
+    // 提交路径只在分配缓冲区和环形缓冲区满需要回收时才获取，保留和填充槽位不需要它
+    spinlock_t ring_lock;
+
+    // 超时或被杀死而放弃等待的直接模式传输，硬件完成后在进程上下文中释放
+    struct list_head direct_orphans;
+    // 本轮回收中收到完成事件、回收结束时要唤醒的文件，受ring_lock保护
+    struct list_head wake_list;
+
+    // 已完成传输的吞吐量(字节/毫秒)的滑动平均，用于推算等待完成的超时；在ring_lock下更新，读者不加锁
+    u64 xfer_rate;
+    // 看门狗：上次检查时的queue_head以及它从何时起没有前进
+    u32 wd_head;
+    u64 wd_since_ns;
+
+    // 回收侧：queue_head由回收路径在ring_lock下推进，提交者无锁地读取它来计算空闲槽位
     u32 queue_head;
+    u32 hw_head_shadow;             // 硬件头指针的缓存副本，位于[queue_head, queue_tail]之间
+
+    // 写者在环形缓冲区或缓冲池已满时在此等待，回收槽位或归还缓冲区时唤醒
+    wait_queue_head_t space_wait_queue;
+    atomic_t pollers;               // 正在忙轮询的调用者个数，不为0时该队列的中断保持屏蔽
+
+    // 提交侧，单独占一个缓存行：提交者用res_tail原子地保留槽位，
+    // 门铃在db_lock下把连续填好的槽位发布到queue_tail并写入硬件尾指针
+    atomic_t res_tail ____cacheline_aligned_in_smp;
+    spinlock_t db_lock;
     u32 queue_tail;
 
-    // 用于中断驱动IO的等待队列
-    wait_queue_head_t dma_wait_queue;
+    // 运行时电源管理：有提交者时队列持有设备的一个使用计数，之后的提交只是一次原子加，不碰设备级的锁；
+    // 空闲MYDMA_PM_IDLE_MS毫秒后由pm_idle释放。pm_lock串行化获取和释放
+    atomic_t pm_users;              // 正在该队列上提交或轮询的调用者个数
+    bool pm_held;
+    struct mutex pm_lock;
+    struct delayed_work pm_idle;
+} ____cacheline_aligned_in_smp;
+
+// 性能计数器，每个CPU一份，只在本CPU上累加，读取时求和，统计本身不引入共享缓存行
+struct mydma_stats {
+    u64 submitted;              // 提交的传输个数
+    u64 completed;              // 完成的传输个数
+    u64 bytes;                  // 完成的字节数
+    u64 ring_full;              // 因环形缓冲区已满而提交失败(-EBUSY)或需要等待的次数
+    u64 timeouts;               // 等待完成超时的次数
+    u64 irqs;                   // 硬中断次数
+    u64 irq_completions;        // 中断线程回收的描述符个数
+    u64 resets;                 // 看门狗发现队列卡死而复位设备的次数
+    u64 crc_errors;             // MYDMA_OPT_CRC32C校验失败、以-EBADMSG结束的传输个数
+    u64 lat_hist[MYDMA_LAT_BUCKETS]; // 提交到完成的延迟，按log2(纳秒)分桶
+};
+
+// 驱动的私有数据结构
+struct mydma_dev {
+    void __iomem *bar0_virt_addr;   // BAR0的内核虚拟地址
+    u32            ring_size;       // 每个队列环形缓冲区的深度，2的幂
+    struct pci_dev *pdev;           // 指向PCI设备的指针，模拟设备为NULL
+    struct device  *dev;            // 用于DMA映射和日志的设备：PCI设备或模拟设备，持有它的引用
+    struct mydma_mock *mock;        // 模拟后端，真实设备为NULL
+    u32            caps;            // MYDMA_REG_DEV_CAPS读出的能力位
+    bool           desc64;          // 使用64字节描述符格式
+    u32            desc_size;       // 每个描述符的字节数
+    u32            inline_max;      // 不超过该字节数的write()使用内联描述符，0表示不使用
+    bool           crc_hw;          // 设备能在描述符中回写CRC32C (MYDMA_CAP_CRC32C)
+    void __iomem  *wc_base;         // BAR2的写合并映射，未启用时为NULL
+    u32            wc_stride;       // 每个队列的写合并窗口大小
+
+    // 字符设备成员
+    struct cdev *cdev;              // 单独分配：最后一个打开的文件关闭之后内核才放下它
+    dev_t dev_num;                  // 次设备号由mydma_minor_idr分配，节点为/dev/mydma<次设备号>
+    struct device *device;
+
+    // 硬件队列，每个队列一个中断向量；cpu_queue[cpu]为open()时该CPU绑定的队列
+    // 末尾的nr_hiprio个队列保留给高优先级文件，不出现在cpu_queue中
+    struct mydma_queue *queues;
+    u32 nr_queues;
+    u32 nr_hiprio;
+    u32 *cpu_queue;
+
+    // 预分配的DMA缓冲池：固定大小的缓冲区，按队列均分，提交路径无需再分配内存
+    // 整个缓冲池是一块连续的一致性内存，各文件可以通过mmap()映射自己申请的缓冲区实现零拷贝
+    dma_addr_t pool_dma_addr;
+    void *pool_virt_addr;
+    size_t pool_size;
+    u32 pool_nr_bufs;
+    struct mydma_buf *pool_bufs;
+    u32 max_transfer;               // 单次write()允许的最大字节数
+
+    struct mydma_stats __percpu *stats;
+    struct dentry *debugfs_dir;
+
+    struct mutex cfg_lock;          // 保护nr_open和files，修改环形缓冲区深度和复位设备时持有
+    u32 nr_open;                    // 打开的文件数，为0时才能修改环形缓冲区深度
+    struct list_head files;         // 打开的文件，解绑时唤醒其等待者并撤销其映射
+    struct delayed_work watchdog;   // 每watchdog_ms毫秒检查一次各队列的头指针是否卡住
+    bool dying;                     // 正在解绑：文件操作和正在等待的调用者返回-ENODEV
+    bool torn_down;                 // 中断、环形缓冲区和缓冲池已释放，受cfg_lock保护，之后的release()不再访问它们
+
+    // 打开的文件和导出的dma-buf各持有一个引用，解绑之后本结构一直保留到最后一个引用放下
+    struct kref ref;
+    struct srcu_struct srcu;        // 文件操作在读侧执行，解绑等它们全部退出之后才释放设备资源
+    bool err_frozen;                // PCI错误恢复期间：中断线程和看门狗已停，等待slot_reset
+};
+
+// 一个队列的描述符环及其软件上下文数组，修改环形缓冲区深度时先整体分配好再替换
+struct mydma_ring_mem {
+    void *virt_addr;
+    dma_addr_t dma_addr;
+    struct dma_context *ctx;
+};
+
+// 映射到用户空间的共享提交/完成队列，布局见mydma_uring_params
+// head/tail的内核侧副本以*_k保存，不信任用户可写的共享内存
+struct mydma_uring {
+    void *region;               // vmalloc_user()分配，整体mmap给用户
+    u32 region_size;
+    u32 sq_entries;
+    u32 cq_entries;
+    u32 *sq_head, *sq_tail;
+    u32 *cq_head, *cq_tail;
+    u32 *cq_overflow;
+    struct mydma_sqe *sqes;
+    struct mydma_cqe *cqes;
+    u32 sq_head_k;
+    u32 cq_tail_k;
+    u32 cq_overflow_k;
+};
+
+// 每个打开的文件对应的上下文
+struct mydma_file {
+    struct mydma_dev *priv_dev; // 持有设备的引用
+    struct file *filp;
+    struct list_head node;      // 挂在priv_dev->files上
+    struct mydma_queue *q;      // open()时按当前CPU绑定的队列，该文件的所有传输都走这个队列
+    bool q_used;                // 已经在q上提交过传输或申请过资源，之后不能再换队列 (MYDMA_OPT_PRIORITY)
+    u32 direct_min;             // write()不小于该字节数时走直接模式，0表示关闭 (MYDMA_OPT_DIRECT_MIN)
+    bool tagged;                // write()/read()带标签头 (MYDMA_OPT_TAGGED)
+    u32 poll_usecs;             // read()/MYDMA_IOC_COMPLETE睡眠前先忙轮询的微秒数 (MYDMA_OPT_POLL_USECS)
+    u32 timeout_ms;             // 等待完成的超时毫秒数，0表示按测得的吞吐量自适应 (MYDMA_OPT_TIMEOUT_MS)
+    bool crc;                   // write()/read()校验数据完整性 (MYDMA_OPT_CRC32C)
+    struct mydma_uring *uring;  // MYDMA_IOC_URING_SETUP之后有效，受ring_lock保护
+
+    // 本文件的完成事件只进入本文件的FIFO、只唤醒本文件的等待者，共用一个队列的文件互不干扰。以下受q->ring_lock保护
+    // 本文件write()已完成、等待read()取走的缓冲区编号，内联传输为MYDMA_DONE_INLINE (容量为done_size)
+    u32 *done_fifo;
+    u32 done_size;              // nr_bufs个缓冲区，支持内联描述符时再加nr_bufs个内联传输
+    u32 done_head;
+    u32 done_count;
+    // 已完成内联传输的结果，与done_fifo中的MYDMA_DONE_INLINE一一对应 (容量为nr_bufs，即队列的inline_nr上限)
+    struct mydma_inline_done *inline_done;
+    u32 inline_head;
+    u32 inline_count;
+    struct list_head wake_node; // 挂在q->wake_list上时表示有待唤醒的完成事件
+    // read()、MYDMA_IOC_COMPLETE、URING_ENTER、直接模式write()和poll()等待本文件的完成事件
+    wait_queue_head_t wait;
+    struct mutex map_lock;      // 串行化缓冲区的mmap()与BUF_FREE，归还的缓冲区不会留下映射
+};
+
+#define mydma_stat_inc(priv_dev, field)    this_cpu_inc((priv_dev)->stats->field)
+#define mydma_stat_add(priv_dev, field, n) this_cpu_add((priv_dev)->stats->field, n)
+
+// 模拟设备中一个队列的状态，受mydma_mock.lock保护
+struct mydma_mock_queue {
+    u32 fetch;                      // 下一个要取的描述符
+    u32 head;                       // 下一个要完成的描述符，与QUEUE_HEAD寄存器一致
+    u32 nr;                         // 已取出尚未完成的描述符个数
+    u64 due_ns[MYDMA_MOCK_WINDOW];  // 已取出的描述符的完成时刻，按槽位号取模索引
+};
+
+// 模拟设备：寄存器窗口、设备模型线程和模拟中断，见"模拟后端"一节
+struct mydma_mock {
+    struct device *dev;
+    void __iomem *regs;             // 模拟的BAR0，是一块普通内存
+    size_t regs_len;
+    u32 nr_queues;
+    struct fwnode_handle *fwnode;
+    struct irq_domain *irq_domain;  // irq_sim，每个队列一个中断
+    struct task_struct *thread;     // 设备模型
+    wait_queue_head_t wait;
+    bool kicked;                    // 睡眠期间有新的门铃
+    spinlock_t lock;                // 设备模型与环形缓冲区复位之间
+    u64 link_free_ns;               // 带宽模型中链路空闲下来的时刻，所有队列共用
+    u64 prio_free_ns;               // 严格优先的队列之间排队用的链路空闲时刻
+    struct mydma_mock_queue q[];
 };
 
 // --- 3. 函数原型 (前置声明) ---
@@ -93,11 +494,31 @@ static int mydma_open(struct inode *inode, struct file *filp);
 static int mydma_release(struct inode *inode, struct file *filp);
 static ssize_t mydma_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos);
 static ssize_t mydma_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos);
+static ssize_t mydma_write_iter(struct kiocb *iocb, struct iov_iter *from);
+static long mydma_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
+static int mydma_mmap(struct file *filp, struct vm_area_struct *vma);
+static __poll_t mydma_poll(struct file *filp, poll_table *wait);
+static void mydma_dev_put(struct mydma_dev *priv_dev);
 static int mydma_probe(struct pci_dev *pdev, const struct pci_device_id *id);
 static void mydma_remove(struct pci_dev *pdev);
 static irqreturn_t mydma_irq_handler(int irq, void *dev);
+static irqreturn_t mydma_irq_thread(int irq, void *dev);
 static int mydma_chrdev_setup(struct mydma_dev *priv_dev);
+static void mydma_reap_locked(struct mydma_queue *q);
+static u32 mydma_reap_budget_locked(struct mydma_queue *q, u32 budget);
 static void mydma_chrdev_cleanup(struct mydma_dev *priv_dev);
+static int mydma_set_ring_size(struct mydma_dev *priv_dev, u32 size);
+static void mydma_mock_kick(struct mydma_mock *m);
+static void mydma_mock_ring_reset(struct mydma_mock *m, u32 qid);
+static void mydma_mock_reset(struct mydma_mock *m);
+static int mydma_mock_irq(struct mydma_mock *m, u32 qid);
+static int mydma_runtime_suspend(struct device *dev);
+static int mydma_runtime_resume(struct device *dev);
+static pci_ers_result_t mydma_error_detected(struct pci_dev *pdev, pci_channel_state_t state);
+static pci_ers_result_t mydma_slot_reset(struct pci_dev *pdev);
+static void mydma_io_resume(struct pci_dev *pdev);
+static void mydma_reset_prepare(struct pci_dev *pdev);
+static void mydma_reset_done(struct pci_dev *pdev);
 
 // --- 4. 全局变量定义 ---
 
@@ -108,6 +529,97 @@ static const struct pci_device_id mydma_id_table[] = {
 };
 MODULE_DEVICE_TABLE(pci, mydma_id_table);
 
+// 所有设备共用的字符设备号区间和设备类
+static dev_t mydma_devt;
+static struct class *mydma_class;
+static DEFINE_IDR(mydma_minor_idr); // 次设备号到mydma_dev，open()按它查找设备
+static DEFINE_MUTEX(mydma_minor_lock);
+
+// 模块参数
+static unsigned int pool_bufs;
+module_param(pool_bufs, uint, 0444);
+MODULE_PARM_DESC(pool_bufs, "Number of page-sized DMA pool buffers, split across queues (default: ring size per queue)");
+
+static unsigned int max_queues;
+module_param(max_queues, uint, 0444);
+MODULE_PARM_DESC(max_queues, "Maximum number of hardware queues (default: one per online CPU)");
+
+// 中断合并：设备支持时写入MYDMA_REG_INT_COAL_*；不支持时由中断线程在屏蔽中断的情况下按预算批量回收
+static unsigned int coal_count = 16;
+module_param(coal_count, uint, 0444);
+MODULE_PARM_DESC(coal_count, "Completions per interrupt when the device supports coalescing (default: 16)");
+
+static unsigned int coal_usecs = 50;
+module_param(coal_usecs, uint, 0444);
+MODULE_PARM_DESC(coal_usecs, "Max usecs a completion may wait for its interrupt when coalescing (default: 50)");
+
+static unsigned int irq_budget = MYDMA_IRQ_BUDGET;
+module_param(irq_budget, uint, 0644);
+MODULE_PARM_DESC(irq_budget, "Descriptors reaped per pass in the IRQ thread before yielding (default: 64)");
+
+// 环形缓冲区深度，向上取2的幂；更深的环形缓冲区允许更多描述符同时在途，用来掩盖PCIe往返延迟
+// 加载后可以在没有打开的文件时通过/sys/class/mydma/mydmaN/ring_size逐个设备修改
+static unsigned int ring_size = 128;
+module_param(ring_size, uint, 0444);
+MODULE_PARM_DESC(ring_size, "Descriptors per hardware ring, rounded up to a power of two in [8, 65536] (default: 128)");
+
+// 设备支持时，把描述符通过pci_iomap_wc()映射的BAR2窗口直接写给设备，省去设备从主机内存取描述符的一次往返
+static bool desc_wc;
+module_param(desc_wc, bool, 0444);
+MODULE_PARM_DESC(desc_wc, "Push descriptors through a write-combined BAR window when the device supports it (default: N)");
+
+// 完成检测方式：轮询一致性内存中描述符的done标志位，只在环形缓冲区看上去已满时才读取MYDMA_REG_QUEUE_HEAD
+static bool desc_poll = true;
+module_param(desc_poll, bool, 0444);
+MODULE_PARM_DESC(desc_poll, "Detect completions from the descriptor done flag instead of MMIO head reads (default: Y)");
+
+static unsigned int inline_max = MYDMA_INLINE_MAX;
+module_param(inline_max, uint, 0444);
+MODULE_PARM_DESC(inline_max, "Writes up to this many bytes travel inside the descriptor when the device supports it, 0 to disable (default: 28)");
+
+// 优先级队列：在每CPU一个的普通队列之外再多要hiprio_queues个队列，设置了MYDMA_OPT_PRIORITY的文件使用它们，
+// 控制消息有自己的环形缓冲区和中断，不会排在大块传输后面；设备支持MYDMA_CAP_QUEUE_ARB时还在取描述符时优先
+static unsigned int hiprio_queues = 1;
+module_param(hiprio_queues, uint, 0444);
+MODULE_PARM_DESC(hiprio_queues, "Extra queues reserved for high-priority files, at least one normal queue is kept (default: 1)");
+
+static unsigned int hiprio_weight;
+module_param(hiprio_weight, uint, 0444);
+MODULE_PARM_DESC(hiprio_weight, "Round-robin weight of high-priority queues against 1 for normal queues, 0 for strict priority (default: 0)");
+
+// 原先解绑时不复位设备：在途DMA还没停就复位，宿主机在虚拟机关机时会出问题。现在先排空再复位，
+// 遇到仍有问题的宿主机可以关掉；排空失败时总是复位，设备不能再访问即将释放的内存
+static bool remove_reset = true;
+module_param(remove_reset, bool, 0644);
+MODULE_PARM_DESC(remove_reset, "Reset the device on unbind once it has been drained (default: Y)");
+
+static unsigned int watchdog_ms = 1000;
+module_param(watchdog_ms, uint, 0444);
+MODULE_PARM_DESC(watchdog_ms, "Period in ms of the stuck-queue watchdog that resets the device, 0 to disable (default: 1000)");
+
+// 模拟后端：不需要硬件即可运行驱动的全部路径，见"模拟后端"一节；需要内核打开CONFIG_IRQ_SIM
+static unsigned int mock_devs;
+module_param(mock_devs, uint, 0444);
+MODULE_PARM_DESC(mock_devs, "Number of emulated devices to create for testing without hardware (default: 0)");
+
+static unsigned int mock_latency_ns = 2000;
+module_param(mock_latency_ns, uint, 0644);
+MODULE_PARM_DESC(mock_latency_ns, "Emulated completion latency per descriptor in ns (default: 2000)");
+
+static unsigned int mock_mbps = 8000;
+module_param(mock_mbps, uint, 0644);
+MODULE_PARM_DESC(mock_mbps, "Emulated bandwidth in MB/s shared by all queues of a device, 0 for unlimited (default: 8000)");
+
+static unsigned int mock_caps = MYDMA_CAP_DESC64 | MYDMA_CAP_INLINE | MYDMA_CAP_QUEUE_ARB | MYDMA_CAP_CRC32C;
+module_param(mock_caps, uint, 0444);
+MODULE_PARM_DESC(mock_caps, "MYDMA_REG_DEV_CAPS of emulated devices, only the 64-byte descriptor, inline, arbitration and CRC32C bits are emulated (default: 30)");
+
+// 运行时电源管理：空闲autosuspend_ms毫秒后挂起，也可以通过/sys/bus/pci/devices/*/power/autosuspend_delay_ms修改。
+// 挂起期间只关闭中断、停掉看门狗，描述符环和缓冲池保持分配，恢复时不重复probe中的分配
+static int autosuspend_ms = 50;
+module_param(autosuspend_ms, int, 0444);
+MODULE_PARM_DESC(autosuspend_ms, "Idle time in ms before the device is runtime suspended, negative to keep it active (default: 50)");
+
 // 文件操作结构体
 static const struct file_operations mydma_fops = {
     .owner   = THIS_MODULE,
@@ -115,6 +627,24 @@ static const struct file_operations mydma_fops = {
     .release = mydma_release,
     .read    = mydma_read,
     .write   = mydma_write,
+    .write_iter = mydma_write_iter,
+    .unlocked_ioctl = mydma_ioctl,
+    .compat_ioctl   = compat_ptr_ioctl,
+    .mmap    = mydma_mmap,
+    .poll    = mydma_poll,
+};
+
+static const struct dev_pm_ops mydma_pm_ops = {
+    SET_RUNTIME_PM_OPS(mydma_runtime_suspend, mydma_runtime_resume, NULL)
+};
+
+// AER恢复和通过sysfs发起的功能级复位：在原地重建队列，不需要重新绑定驱动
+static const struct pci_error_handlers mydma_err_handler = {
+    .error_detected = mydma_error_detected,
+    .slot_reset     = mydma_slot_reset,
+    .resume         = mydma_io_resume,
+    .reset_prepare  = mydma_reset_prepare,
+    .reset_done     = mydma_reset_done,
 };
 
 // PCI驱动结构体
@@ -123,330 +653,4016 @@ static struct pci_driver mydma_driver = {
     .id_table = mydma_id_table,
     .probe    = mydma_probe,
     .remove   = mydma_remove,
+    .err_handler = &mydma_err_handler,
+    .driver.pm = &mydma_pm_ops,
+    .driver.probe_type = PROBE_PREFER_ASYNCHRONOUS, // 多块卡并行probe
 };
 
 
 // --- 5. 函数实现 ---
 
-static int mydma_open(struct inode *inode, struct file *filp)
+// 唤醒等待空间的写者；没有等待者时不碰等待队列的锁。
+// 直接模式和dma-buf传输以killable方式睡眠，wake_up_interruptible()唤不醒它们
+static inline void mydma_wake_space(struct mydma_queue *q)
 {
-    struct mydma_dev *priv_dev = container_of(inode->i_cdev, struct mydma_dev, cdev);
-    filp->private_data = priv_dev;
-    pr_info("mydma: open() called\n");
-    return 0;
+    if (wq_has_sleeper(&q->space_wait_queue))
+        wake_up(&q->space_wait_queue);
 }
 
-static int mydma_release(struct inode *inode, struct file *filp)
+// 记下收到完成事件的文件，本轮回收结束时由mydma_wake_files_locked()统一唤醒；调用者需持有ring_lock
+static inline void mydma_file_mark_locked(struct mydma_queue *q, struct mydma_file *f)
 {
-    pr_info("mydma: release() called\n");
-    return 0;
+    if (f && list_empty(&f->wake_node))
+        list_add_tail(&f->wake_node, &q->wake_list);
 }
 
-static ssize_t mydma_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos)
+// 只唤醒收到了完成事件的文件，每个文件每轮至少唤醒一次；调用者需持有ring_lock
+static void mydma_wake_files_locked(struct mydma_queue *q)
 {
-    struct mydma_dev *priv_dev = filp->private_data;
-    u32 hw_head;
-    long timeout;
-    int ret;
-    struct dma_context *ctx;
-    struct dma_descriptor *desc;
-    size_t bytes_to_copy;
+    struct mydma_file *f, *tmp;
 
-    pr_info("mydma: read() called, count=%zu\n", count);
+    list_for_each_entry_safe(f, tmp, &q->wake_list, wake_node) {
+        list_del_init(&f->wake_node);
+        if (wq_has_sleeper(&f->wait))
+            wake_up(&f->wait);
+    }
+}
 
-    hw_head = readl(priv_dev->bar0_virt_addr + MYDMA_REG_QUEUE_HEAD);
+// 从队列的缓冲池分片中取nr个相邻的空闲缓冲区，owner为NULL表示供write()/read()使用；调用者需持有ring_lock
+static struct mydma_buf *mydma_buf_get_locked(struct mydma_queue *q, struct mydma_file *owner, u32 nr)
+{
+    struct mydma_buf *b;
+    unsigned long idx;
 
-    // 如果驱动的头指针与硬件的头指针相同，说明没有已完成的任务，需要等待
-    if (priv_dev->queue_head == hw_head) {
-        // 在等待队列上休眠，直到被中断唤醒或超时
-        timeout = wait_event_interruptible_timeout(
-                      priv_dev->dma_wait_queue,
-                      // 唤醒条件：硬件头指针前进了
-                      readl(priv_dev->bar0_virt_addr + MYDMA_REG_QUEUE_HEAD) != priv_dev->queue_head,
-                      msecs_to_jiffies(5000) // 5秒超时
-                  );
-        if (timeout == 0) { dev_err(&priv_dev->pdev->dev, "Read timeout!\n"); return -ETIMEDOUT; }
-        if (timeout < 0) { dev_err(&priv_dev->pdev->dev, "Read interrupted!\n"); return timeout; }
-        hw_head = readl(priv_dev->bar0_virt_addr + MYDMA_REG_QUEUE_HEAD);
-    }
+    idx = bitmap_find_next_zero_area(q->pool_bitmap, q->nr_bufs, 0, nr, 0);
+    if (idx >= q->nr_bufs) return NULL;
+    bitmap_set(q->pool_bitmap, idx, nr);
 
-    // 获取已完成任务的软件上下文和硬件描述符
-    ctx = &priv_dev->dma_ctx_ring[priv_dev->queue_head];
-    desc = &priv_dev->ring_buffer_virt_addr[priv_dev->queue_head];
+    b = &q->priv_dev->pool_bufs[q->buf_base + idx];
+    b->nr_bufs = nr;
+    b->state = MYDMA_BUF_OWNED;
+    b->owner = owner;
+    b->file = owner;
+    b->orphan = false;
+    b->len = 0;
+    b->res = 0;
+    b->crc_check = MYDMA_CRC_NONE;
+    return b;
+}
 
-    // 安全检查：确保唤醒后描述符确实已完成
-    if (desc->done != 0) {
-        dev_err(&priv_dev->pdev->dev, "DMA descriptor %u still not done (0x%x) after wake-up!\n",
-                priv_dev->queue_head, desc->done);
-        return -EIO;
-    }
-    rmb(); // 读内存屏障，确保先读取done标志位，再访问DMA缓冲区内容
+// 将缓冲区归还缓冲池；调用者需持有ring_lock
+static void mydma_buf_put_locked(struct mydma_queue *q, struct mydma_buf *b)
+{
+    b->state = MYDMA_BUF_FREE;
+    b->owner = NULL;
+    b->file = NULL;
+    b->orphan = false;
+    bitmap_clear(q->pool_bitmap, b - q->priv_dev->pool_bufs - q->buf_base, b->nr_bufs);
+    mydma_wake_space(q);
+}
 
-    bytes_to_copy = min(count, ctx->size);
+// 传输完成后释放一个缓冲区：持有者已关闭文件的归还缓冲池，仍被导出为dma-buf时等最后一个dma-buf释放；
+// 否则重新归用户所有。调用者需持有ring_lock
+static void mydma_buf_release_locked(struct mydma_queue *q, struct mydma_buf *b)
+{
+    if (!b->orphan || b->exports) b->state = MYDMA_BUF_OWNED;
+    else mydma_buf_put_locked(q, b);
+}
 
-    // 将DMA完成的数据从内核空间拷贝到用户空间
-    ret = copy_to_user(buf, ctx->virt_addr, bytes_to_copy);
-    if (ret) {
-        dev_err(&priv_dev->pdev->dev, "read: copy_to_user failed (bytes not copied: %d)\n", ret);
-    }
+// 同mydma_buf_get_locked()，调用者不持有ring_lock
+static struct mydma_buf *mydma_buf_get(struct mydma_queue *q, struct mydma_file *owner, u32 nr)
+{
+    struct mydma_buf *b;
 
-    pr_info("mydma: Read %zu bytes from completed DMA descriptor %u.\n", bytes_to_copy, priv_dev->queue_head);
+    spin_lock(&q->ring_lock);
+    b = mydma_buf_get_locked(q, owner, nr);
+    spin_unlock(&q->ring_lock);
+    return b;
+}
 
-    // 释放本次DMA操作使用的缓冲区
-    dma_free_coherent(&priv_dev->pdev->dev, ctx->size, ctx->virt_addr, ctx->dma_addr);
-    memset(ctx, 0, sizeof(*ctx)); // 清理上下文槽位
+// 尝试无锁地保留[nr_min, nr_max]个连续槽位，成功时*slot为第一个槽位并返回保留的个数，空间不足时返回0
+// 保留的槽位必须全部填好并置为READY，否则门铃会停在空洞处
+static u32 mydma_slots_try_reserve(struct mydma_queue *q, u32 nr_min, u32 nr_max, u32 *slot)
+{
+    u32 old, head, space, nr;
 
-    // 驱动头指针前进
-    priv_dev->queue_head = (priv_dev->queue_head + 1) % priv_dev->ring_size;
+    do {
+        old = atomic_read(&q->res_tail);
+        if (unlikely(old & MYDMA_RES_STOPPED)) return 0;
+        // 与回收路径对queue_head的release写配对，保证看到槽位已被置为FREE
+        head = smp_load_acquire(&q->queue_head);
+        // 保留一个槽位用于区分空和满
+        space = (head + q->ring_size - old - 1) & q->ring_mask;
+        if (space < nr_min) return 0;
+        nr = min(space, nr_max);
+    } while (atomic_cmpxchg(&q->res_tail, old, (old + nr) & q->ring_mask) != old);
 
-    return ret ? -EFAULT : bytes_to_copy; // 如果拷贝失败返回错误，否则返回拷贝的字节数
+    *slot = old;
+    return nr;
 }
 
-static ssize_t mydma_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos)
+// 重新读取硬件头指针。设备从总线上断开(AER、热拔出)时MMIO读回全1，这种越界的值不予采信
+static void mydma_sync_hw_head(struct mydma_queue *q)
 {
-    struct mydma_dev *priv_dev = filp->private_data;
-    u32 next_tail;
-    u32 hw_head;
-    struct dma_context *ctx;
-    struct dma_descriptor *desc;
-    int ret;
+    u32 head = readl(q->regs + MYDMA_REG_QUEUE_HEAD);
 
-    if (count == 0) return 0;
-    if (count > MAX_DMA_TRANSFER_SIZE) {
-        dev_warn(&priv_dev->pdev->dev, "Write size %zu exceeds max %lu\n", count, MAX_DMA_TRANSFER_SIZE);
-        return -EINVAL;
+    if (likely(head <= q->ring_mask)) q->hw_head_shadow = head;
+}
+
+// 为保留槽位腾出空间：回收硬件已完成的描述符；调用者需持有ring_lock
+static void mydma_ring_make_space_locked(struct mydma_queue *q)
+{
+    u32 res_tail;
+
+    mydma_reap_locked(q);
+    res_tail = atomic_read(&q->res_tail);
+    if ((q->queue_head + q->ring_size - res_tail - 1) & q->ring_mask || !desc_poll)
+        return;
+
+    // 按done标志位看环形缓冲区已满，此时才读一次硬件头指针重新同步影子副本
+    mydma_sync_hw_head(q);
+    mydma_reap_locked(q);
+}
+
+// 保留槽位，空间不足时先回收再重试一次；调用者需持有ring_lock
+static u32 mydma_slots_reserve_locked(struct mydma_queue *q, u32 nr_min, u32 nr_max, u32 *slot)
+{
+    u32 nr = mydma_slots_try_reserve(q, nr_min, nr_max, slot);
+
+    if (nr) return nr;
+    mydma_ring_make_space_locked(q);
+    nr = mydma_slots_try_reserve(q, nr_min, nr_max, slot);
+    if (!nr) {
+        mydma_stat_inc(q->priv_dev, ring_full);
+        trace_mydma_ring_full(q->qid, q->queue_head, atomic_read(&q->res_tail), nr_min);
     }
+    return nr;
+}
 
-    // 检查环形缓冲区是否已满
-    next_tail = (priv_dev->queue_tail + 1) % priv_dev->ring_size;
-    hw_head = readl(priv_dev->bar0_virt_addr + MYDMA_REG_QUEUE_HEAD);
-    if (next_tail == hw_head) {
-        dev_warn(&priv_dev->pdev->dev, "DMA queue is full\n");
-        return -EBUSY;
+// 同上，但调用者不持有ring_lock：只在需要回收时才短暂获取
+static u32 mydma_slots_reserve(struct mydma_queue *q, u32 nr_min, u32 nr_max, u32 *slot)
+{
+    u32 nr = mydma_slots_try_reserve(q, nr_min, nr_max, slot);
+
+    if (nr) return nr;
+    spin_lock(&q->ring_lock);
+    mydma_ring_make_space_locked(q);
+    spin_unlock(&q->ring_lock);
+    nr = mydma_slots_try_reserve(q, nr_min, nr_max, slot);
+    if (!nr) {
+        mydma_stat_inc(q->priv_dev, ring_full);
+        trace_mydma_ring_full(q->qid, READ_ONCE(q->queue_head), atomic_read(&q->res_tail), nr_min);
     }
+    return nr;
+}
 
-    ctx = &priv_dev->dma_ctx_ring[priv_dev->queue_tail];
+// 传输len字节所需的描述符个数
+static inline u32 mydma_desc_count(u32 len)
+{
+    return DIV_ROUND_UP(len, MYDMA_DESC_MAX_LEN);
+}
 
-    // 为本次“就地”DMA操作分配一个缓冲区
-    ctx->size = count;
-    ctx->virt_addr = dma_alloc_coherent(&priv_dev->pdev->dev, count, &ctx->dma_addr, GFP_KERNEL);
-    if (!ctx->virt_addr) {
-        dev_err(&priv_dev->pdev->dev, "Failed to allocate DMA buffer\n");
-        return -ENOMEM;
+// 把在栈上拼好的64字节描述符中驱动填写的部分连续写到slot处，不会出现一行里混有上一轮字段的中间状态
+static inline void mydma_emit_desc64(struct mydma_queue *q, u32 slot, const struct mydma_desc64 *d64)
+{
+    if (q->wc_ring)
+        __iowrite64_copy(q->wc_ring + slot * sizeof(*d64), d64, MYDMA_DESC64_SW_BYTES / 8);
+    else
+        memcpy(&q->ring_desc64[slot], d64, MYDMA_DESC64_SW_BYTES);
+}
+
+// 填写slot处的硬件描述符
+static inline void mydma_write_desc(struct mydma_queue *q, u32 slot, dma_addr_t in_addr, dma_addr_t out_addr,
+                                    u32 len, u32 flags)
+{
+    struct dma_context *ctx = &q->dma_ctx_ring[slot];
+    struct dma_descriptor *desc;
+    struct mydma_desc64 d64;
+
+    if (q->desc64) {
+        ctx->phase ^= 1;
+        d64 = (struct mydma_desc64) {
+            .in_addr  = in_addr,
+            .out_addr = out_addr,
+            .in_len   = len,
+            .out_len  = len,
+            .flags    = flags | (ctx->phase ? MYDMA_DESC_F_PHASE : 0),
+        };
+        mydma_emit_desc64(q, slot, &d64);
+        return;
     }
 
-    // 从用户空间拷贝数据到DMA缓冲区
-    ret = copy_from_user(ctx->virt_addr, buf, count);
-    if (ret) {
-        dev_err(&priv_dev->pdev->dev, "write: copy_from_user failed\n");
-        dma_free_coherent(&priv_dev->pdev->dev, ctx->size, ctx->virt_addr, ctx->dma_addr);
-        memset(ctx, 0, sizeof(*ctx));
-        return -EFAULT;
-    }
-
-    // 填充硬件描述符
-    desc = &priv_dev->ring_buffer_virt_addr[priv_dev->queue_tail];
-    desc->in_addr = ctx->dma_addr;
-    desc->out_addr = ctx->dma_addr; // 就地操作：输入和输出地址相同
-    desc->in_len = ctx->size;
-    desc->out_len = ctx->size;
+    desc = &q->ring_buffer_virt_addr[slot];
+    desc->in_addr = in_addr;
+    desc->out_addr = out_addr;
+    desc->in_len = len;
+    desc->out_len = len;
+    desc->flags = flags;
     desc->done = 0xFF00; // 设置为待处理状态
+}
 
-    wmb(); // 写内存屏障，确保描述符内容在更新尾指针前已写入内存
+// 填写slot处的内联描述符：len字节的数据就放在描述符内，只用于64字节格式
+static inline void mydma_write_desc_inline(struct mydma_queue *q, u32 slot, const void *data, u32 len)
+{
+    struct dma_context *ctx = &q->dma_ctx_ring[slot];
+    struct mydma_desc64 d64 = { .in_len = len, .out_len = len };
 
-    // 更新硬件的尾指针，正式提交任务
-    priv_dev->queue_tail = next_tail;
-    writel(priv_dev->queue_tail, priv_dev->bar0_virt_addr + MYDMA_REG_QUEUE_TAIL);
+    ctx->phase ^= 1;
+    d64.flags = MYDMA_DESC_F_INLINE | MYDMA_DESC_F_LAST | (ctx->phase ? MYDMA_DESC_F_PHASE : 0);
+    memcpy(d64.inline_data, data, len);
+    mydma_emit_desc64(q, slot, &d64);
+}
 
-    pr_info("mydma: Submitted in-place DMA req %u, dma_addr=0x%pad, len=%zu\n",
-            (next_tail - 1 + priv_dev->ring_size) % priv_dev->ring_size, &ctx->dma_addr, count);
+// slot处的描述符是否已被硬件处理完毕
+static inline bool mydma_desc_is_done(struct mydma_queue *q, u32 slot)
+{
+    u32 st;
 
-    return count;
+    if (q->desc64) {
+        st = READ_ONCE(q->ring_desc64[slot].status);
+        return (st & MYDMA_DESC_ST_DONE) && !!(st & MYDMA_DESC_ST_PHASE) == q->dma_ctx_ring[slot].phase;
+    }
+    return READ_ONCE(q->ring_buffer_virt_addr[slot].done) == 0;
 }
 
-static int mydma_chrdev_setup(struct mydma_dev *priv_dev)
+// 从已保留的slot开始为一段DMA连续的区域填充描述符：超过MYDMA_DESC_MAX_LEN的部分拆成多个描述符，
+// 并用CHAIN/LAST标志串联；last表示这段区域是否为本次传输的结尾。返回下一个槽位
+// 不需要持锁：保留的槽位只属于调用者，填好后逐个置为READY
+static u32 mydma_fill_descs(struct mydma_queue *q, u32 slot, struct mydma_buf *b,
+                            dma_addr_t in_addr, dma_addr_t out_addr, u32 len, bool last)
 {
-    int ret;
-    struct pci_dev *pdev = priv_dev->pdev;
+    struct dma_context *ctx;
+    u32 seg, flags;
 
-    ret = alloc_chrdev_region(&priv_dev->dev_num, 0, 1, DEVICE_NAME);
-    if (ret) { dev_err(&pdev->dev, "Failed to allocate chrdev region\n"); return ret; }
+    while (len) {
+        seg = min_t(u32, len, MYDMA_DESC_MAX_LEN);
+        flags = (last && seg == len) ? MYDMA_DESC_F_LAST : MYDMA_DESC_F_CHAIN;
+        if (b && b->crc_check == MYDMA_CRC_HW) flags |= MYDMA_DESC_F_CRC;
 
-    priv_dev->dev_class = class_create(THIS_MODULE, DEVICE_NAME);
-    if (IS_ERR(priv_dev->dev_class)) {
-        ret = PTR_ERR(priv_dev->dev_class);
-        dev_err(&pdev->dev, "Failed to create device class\n");
-        goto err_unregister_chrdev;
-    }
+        ctx = &q->dma_ctx_ring[slot];
+        ctx->buf = b;
+        ctx->size = seg;
 
-    cdev_init(&priv_dev->cdev, &mydma_fops);
-    priv_dev->cdev.owner = THIS_MODULE;
+        // 就地操作时输出地址与输入地址相同
+        mydma_write_desc(q, slot, in_addr, out_addr, seg, flags);
+        trace_mydma_submit(q->qid, slot, in_addr, out_addr, seg, flags);
 
-    ret = cdev_add(&priv_dev->cdev, priv_dev->dev_num, 1);
-    if (ret) {
-        dev_err(&pdev->dev, "Failed to add cdev\n");
-        goto err_class_destroy;
-    }
+        // 先写完描述符和上下文，再让门铃看到READY
+        smp_store_release(&ctx->state, MYDMA_SLOT_READY);
 
-    priv_dev->device = device_create(priv_dev->dev_class, &pdev->dev, priv_dev->dev_num, NULL, DEVICE_NAME "0");
-    if (IS_ERR(priv_dev->device)) {
-        ret = PTR_ERR(priv_dev->device);
-        dev_err(&pdev->dev, "Failed to create device node\n");
-        goto err_cdev_del;
+        slot = (slot + 1) & q->ring_mask;
+        in_addr += seg;
+        out_addr += seg;
+        len -= seg;
     }
-    pr_info("mydma: Character device created at /dev/%s0\n", DEVICE_NAME);
-    return 0;
-
-err_cdev_del: cdev_del(&priv_dev->cdev);
-err_class_destroy: class_destroy(priv_dev->dev_class);
-err_unregister_chrdev: unregister_chrdev_region(priv_dev->dev_num, 1);
-    return ret;
+    return slot;
 }
 
-static void mydma_chrdev_cleanup(struct mydma_dev *priv_dev)
+// 在已保留的slot处为缓冲区b中的len字节排队描述符但暂不通知硬件，返回下一个槽位
+// 调用者需已保留mydma_desc_count(len)个槽位，并且是缓冲区的唯一使用者(或持有ring_lock)
+static u32 mydma_queue_desc(struct mydma_queue *q, u32 slot, struct mydma_buf *b, u32 len)
 {
-    if (!priv_dev) return;
-    if (priv_dev->device) device_destroy(priv_dev->dev_class, priv_dev->dev_num);
-    if (priv_dev->cdev.owner) cdev_del(&priv_dev->cdev);
-    if (priv_dev->dev_class) class_destroy(priv_dev->dev_class);
-    if (priv_dev->dev_num) unregister_chrdev_region(priv_dev->dev_num, 1);
-    pr_info("mydma: Character device cleaned up\n");
+    b->len = len;
+    b->pending = mydma_desc_count(len);
+    b->state = MYDMA_BUF_INFLIGHT;
+    mydma_stat_inc(q->priv_dev, submitted);
+    return mydma_fill_descs(q, slot, b, b->dma_addr, b->dma_addr, len, true);
 }
 
-static irqreturn_t mydma_irq_handler(int irq, void *dev)
+// 门铃：从已发布的尾指针开始，把连续的READY槽位按顺序交给硬件，一次写内存屏障加一次尾指针写
+// 并发的提交者各自填好描述符后都可以敲门铃，先敲的会顺带发布后面已填好的槽位；db_lock只保护这一步。
+// PCI错误恢复期间设备可能已经复位、还没有重新设置环形缓冲区地址，这时不写尾指针，
+// 填好的槽位留在READY，由mydma_rebuild()中止
+static void mydma_ring_doorbell(struct mydma_queue *q)
 {
-    struct mydma_dev *priv_dev = (struct mydma_dev *)dev;
-    pr_info("mydma: Interrupt received!\n");
-    wake_up_interruptible(&priv_dev->dma_wait_queue);
-    return IRQ_HANDLED;
+    struct dma_context *ctx;
+    u32 tail;
+    u64 now;
+
+    spin_lock(&q->db_lock);
+    if (unlikely(READ_ONCE(q->priv_dev->err_frozen))) {
+        spin_unlock(&q->db_lock);
+        return;
+    }
+    tail = q->queue_tail;
+    now = ktime_get_ns(); // 紧接着就写尾指针寄存器，作为本批描述符的提交时间
+    for (;;) {
+        ctx = &q->dma_ctx_ring[tail];
+        if (smp_load_acquire(&ctx->state) != MYDMA_SLOT_READY) break;
+        ctx->state = MYDMA_SLOT_INFLIGHT;
+        ctx->submit_ns = now;
+        tail = (tail + 1) & q->ring_mask;
+    }
+
+    if (tail != q->queue_tail) {
+        wmb(); // 写内存屏障，确保描述符内容在更新尾指针前已写入内存 (写合并窗口的缓冲也在此刷出)
+
+        // 与回收路径的acquire读配对，回收路径只会看到已经填好的槽位
+        smp_store_release(&q->queue_tail, tail);
+        // 更新硬件的尾指针，正式提交任务
+        writel(tail, q->regs + MYDMA_REG_QUEUE_TAIL);
+        if (unlikely(q->priv_dev->mock)) mydma_mock_kick(q->priv_dev->mock);
+    }
+    spin_unlock(&q->db_lock);
 }
 
-static int mydma_probe(struct pci_dev *pdev, const struct pci_device_id *id)
+// 将一个已填好数据的缓冲区提交给硬件，调用者是缓冲区的唯一使用者，不需要持锁
+static int mydma_submit(struct mydma_queue *q, struct mydma_buf *b, u32 len)
 {
-    int ret;
-    struct mydma_dev *priv_dev;
+    u32 need = mydma_desc_count(len);
+    u32 slot;
 
-    priv_dev = devm_kzalloc(&pdev->dev, sizeof(struct mydma_dev), GFP_KERNEL);
-    if (!priv_dev) { return -ENOMEM; }
-    pci_set_drvdata(pdev, priv_dev);
-    priv_dev->pdev = pdev;
+    // 检查环形缓冲区是否放得下本次传输的全部描述符
+    if (!mydma_slots_reserve(q, need, need, &slot))
+        return -EBUSY;
 
-    ret = pci_enable_device(pdev);
-    if (ret) { dev_err(&pdev->dev, "pci_enable_device failed\n"); return ret; }
+    mydma_queue_desc(q, slot, b, len);
+    mydma_ring_doorbell(q);
+    return 0;
+}
 
-    ret = pci_request_regions(pdev, DRIVER_NAME);
-    if (ret) { dev_err(&pdev->dev, "pci_request_regions failed\n"); goto err_disable_device; }
+// 同上，用于零拷贝路径：调用者持有ring_lock以检查缓冲区的归属和状态
+static int mydma_submit_locked(struct mydma_queue *q, struct mydma_buf *b, u32 len)
+{
+    u32 need = mydma_desc_count(len);
+    u32 slot;
 
-    priv_dev->bar0_virt_addr = pci_iomap(pdev, 0, 0);
-    if (!priv_dev->bar0_virt_addr) { ret = -EIO; dev_err(&pdev->dev, "pci_iomap failed\n"); goto err_release_regions; }
+    if (!mydma_slots_reserve_locked(q, need, need, &slot))
+        return -EBUSY;
 
-    writel(0x80000000, priv_dev->bar0_virt_addr + MYDMA_REG_DEV_RESET);
+    mydma_queue_desc(q, slot, b, len);
+    mydma_ring_doorbell(q);
+    return 0;
+}
 
-    ret = dma_set_mask_and_coherent(&pdev->dev, DMA_BIT_MASK(64));
-    if (ret) { ret = dma_set_mask_and_coherent(&pdev->dev, DMA_BIT_MASK(32)); }
-    if (ret) { dev_err(&pdev->dev, "DMA configuration failed\n"); goto err_iounmap; }
+// 异地传输：从in读取len字节，结果写入out，两者都是缓冲池中的缓冲区，不经过反弹拷贝。
+// 完成状态记在out上；in在传输期间同样处于INFLIGHT，完成后重新归用户所有
+static int mydma_submit_oop_locked(struct mydma_queue *q, struct mydma_buf *in,
+                                   struct mydma_buf *out, u32 len)
+{
+    u32 slot;
 
-    u32 ring_size = 128;
-    writel(ring_size, priv_dev->bar0_virt_addr + MYDMA_REG_RING_SIZE);
-    priv_dev->ring_size = readl(priv_dev->bar0_virt_addr + MYDMA_REG_RING_SIZE);
-    if (priv_dev->ring_size != ring_size) { ret = -EIO; dev_err(&pdev->dev, "Ring size mismatch\n"); goto err_iounmap; }
-    pr_info("mydma: Set ring size to %u\n", priv_dev->ring_size);
+    if (!mydma_slots_reserve_locked(q, 1, 1, &slot))
+        return -EBUSY;
 
-    priv_dev->ring_buffer_size = priv_dev->ring_size * sizeof(struct dma_descriptor);
-    priv_dev->ring_buffer_virt_addr = dma_alloc_coherent(&pdev->dev, priv_dev->ring_buffer_size, &priv_dev->ring_buffer_dma_addr, GFP_KERNEL);
-    if (!priv_dev->ring_buffer_virt_addr) { ret = -ENOMEM; dev_err(&pdev->dev, "ring buffer alloc failed\n"); goto err_iounmap; }
-    pr_info("mydma: Allocated ring buffer, dma_addr=0x%pad\n", &priv_dev->ring_buffer_dma_addr);
+    out->len = len;
+    out->pending = 1;
+    out->state = MYDMA_BUF_INFLIGHT;
+    out->src = in;
+    in->state = MYDMA_BUF_INFLIGHT;
+    mydma_stat_inc(q->priv_dev, submitted);
+    mydma_fill_descs(q, slot, out, in->dma_addr, out->dma_addr, len, true);
+    mydma_ring_doorbell(q);
+    return 0;
+}
 
-    priv_dev->dma_ctx_ring = devm_kcalloc(&pdev->dev, priv_dev->ring_size, sizeof(struct dma_context), GFP_KERNEL);
-    if (!priv_dev->dma_ctx_ring) { ret = -ENOMEM; goto err_free_ring; }
-    pr_info("mydma: Allocated software context ring\n");
+// 向共享完成队列追加一个CQE，CQ已满时返回false并累加溢出计数；调用者需持有ring_lock
+static bool mydma_uring_post_cqe_locked(struct mydma_uring *ur, u32 buf, u32 len, s32 res, u64 user_data)
+{
+    u32 tail = ur->cq_tail_k;
+    struct mydma_cqe *cqe;
 
-    writel(upper_32_bits(priv_dev->ring_buffer_dma_addr), priv_dev->bar0_virt_addr + MYDMA_REG_RING_ADDR_HI);
-    writel(lower_32_bits(priv_dev->ring_buffer_dma_addr), priv_dev->bar0_virt_addr + MYDMA_REG_RING_ADDR_LO);
+    if (tail - READ_ONCE(*ur->cq_head) >= ur->cq_entries) {
+        WRITE_ONCE(*ur->cq_overflow, ++ur->cq_overflow_k);
+        return false;
+    }
 
-    ret = pci_alloc_irq_vectors(pdev, 1, 1, PCI_IRQ_MSI);
-    if (ret < 0) { dev_err(&pdev->dev, "pci_alloc_irq_vectors failed\n"); goto err_free_ctx; }
+    cqe = &ur->cqes[tail & (ur->cq_entries - 1)];
+    cqe->buf = buf;
+    cqe->len = len;
+    cqe->res = res;
+    cqe->flags = 0;
+    cqe->user_data = user_data;
 
-    priv_dev->irq = pci_irq_vector(pdev, 0);
-    ret = request_irq(priv_dev->irq, mydma_irq_handler, 0, DRIVER_NAME, priv_dev);
-    if (ret) { dev_err(&pdev->dev, "request_irq failed\n"); goto err_free_irq_vectors; }
-    pr_info("mydma: Requested IRQ %d\n", priv_dev->irq);
+    // 先写CQE内容，再发布cq_tail，与用户侧对cq_tail的acquire读配对
+    ur->cq_tail_k = tail + 1;
+    smp_store_release(ur->cq_tail, ur->cq_tail_k);
+    return true;
+}
 
-    init_waitqueue_head(&priv_dev->dma_wait_queue);
-    writel(1, priv_dev->bar0_virt_addr + MYDMA_REG_INT_ENABLE);
-    pr_info("mydma: Hardware interrupts enabled\n");
+// 判断queue_head处的描述符是否已完成；调用者需持有ring_lock
+// 影子头指针已越过它时直接认为完成；否则desc_poll模式下看done标志位，不访问MMIO，寄存器模式下重新读取硬件头指针
+static bool mydma_desc_done_locked(struct mydma_queue *q)
+{
+    u32 head = q->queue_head;
 
-    priv_dev->queue_head = 0;
-    priv_dev->queue_tail = 0;
+    // 与门铃对queue_tail的release写配对，只看已发布的槽位
+    if (head == smp_load_acquire(&q->queue_tail))
+        return false;
+    if (head != q->hw_head_shadow)
+        return true;
+    if (desc_poll)
+        return mydma_desc_is_done(q, head);
 
-    ret = mydma_chrdev_setup(priv_dev);
-    if (ret) { goto err_free_irq; }
+    mydma_sync_hw_head(q);
+    return head != q->hw_head_shadow;
+}
 
-    pr_info("mydma: probe successful\n");
-    return 0;
+// 统计一次完成的传输：以slot处最后完成的描述符的提交时间计算整次传输的延迟，
+// 成功的传输顺带更新吞吐量的滑动平均(权重1/8)；调用者需持有ring_lock
+static void mydma_account_locked(struct mydma_queue *q, u32 slot, u32 len, int res)
+{
+    struct mydma_dev *priv_dev = q->priv_dev;
+    u64 lat = ktime_get_ns() - q->dma_ctx_ring[slot].submit_ns;
+    u64 rate;
 
-err_free_irq:
-    writel(0, priv_dev->bar0_virt_addr + MYDMA_REG_INT_ENABLE);
-    free_irq(priv_dev->irq, priv_dev);
-err_free_irq_vectors:
-    pci_free_irq_vectors(pdev);
-err_free_ctx:
-    /* devm_kcalloc for dma_ctx_ring is auto-freed */
-err_free_ring:
-    dma_free_coherent(&pdev->dev, priv_dev->ring_buffer_size, priv_dev->ring_buffer_virt_addr, priv_dev->ring_buffer_dma_addr);
-err_iounmap:
-    pci_iounmap(pdev, priv_dev->bar0_virt_addr);
-err_release_regions:
-    pci_release_regions(pdev);
-err_disable_device:
-    pci_disable_device(pdev);
-    pci_set_drvdata(pdev, NULL);
-    return ret;
+    if (!res) {
+        rate = div64_u64((u64)len * NSEC_PER_MSEC, max_t(u64, lat, 1));
+        WRITE_ONCE(q->xfer_rate, q->xfer_rate ? q->xfer_rate - (q->xfer_rate >> 3) + (rate >> 3) : rate);
+    }
+    mydma_stat_inc(priv_dev, completed);
+    mydma_stat_add(priv_dev, bytes, len);
+    mydma_stat_inc(priv_dev, lat_hist[min_t(u32, lat ? ilog2(lat) : 0, MYDMA_LAT_BUCKETS - 1)]);
+    trace_mydma_complete(q->qid, slot, len, lat);
 }
 
-static void mydma_remove(struct pci_dev *pdev)
+// 内联传输完成：把设备写回描述符的结果拷贝出来，与缓冲区传输一起按完成顺序排进发起文件的完成FIFO。
+// 发起文件已关闭时丢弃结果，归还它占用的名额；调用者需持有ring_lock
+static void mydma_inline_done_locked(struct mydma_queue *q, u32 slot, int res)
 {
-    struct mydma_dev *priv_dev = pci_get_drvdata(pdev);
-    if (!priv_dev) return;
+    struct dma_context *ctx = &q->dma_ctx_ring[slot];
+    struct mydma_file *f = ctx->file;
+    struct mydma_inline_done *inl;
 
-    pr_info("mydma: remove function called\n");
+    mydma_account_locked(q, slot, ctx->size, res);
+    ctx->file = NULL;
+    if (!f) {
+        atomic_dec(&q->inline_nr);
+        mydma_wake_space(q);
+        return;
+    }
 
-    mydma_chrdev_cleanup(priv_dev);
+    inl = &f->inline_done[(f->inline_head + f->inline_count) % q->nr_bufs];
+    dma_rmb(); // 先看到status，再读设备写回的数据
+    inl->len = ctx->size;
+    inl->res = res;
+    inl->user_data = ctx->user_data;
+    memcpy(inl->data, q->ring_desc64[slot].inline_data, ctx->size);
+    f->inline_count++;
+    f->done_fifo[(f->done_head + f->done_count) % f->done_size] = MYDMA_DONE_INLINE;
+    f->done_count++;
+    mydma_file_mark_locked(q, f);
+}
 
-    writel(0, priv_dev->bar0_virt_addr + MYDMA_REG_INT_ENABLE);
-    free_irq(priv_dev->irq, priv_dev);
-    pci_free_irq_vectors(pdev);
-#if 0 // remove drv then powerof vm machine bug in host kernel
-    writel(0, priv_dev->bar0_virt_addr + MYDMA_REG_RING_ADDR_HI);
-    writel(0, priv_dev->bar0_virt_addr + MYDMA_REG_RING_ADDR_LO);
-    writel(0x80000000, priv_dev->bar0_virt_addr + MYDMA_REG_DEV_RESET);
-#endif
+// 投递slot处已完成描述符的完成事件：一次传输的全部描述符都完成后，把缓冲区交给发起文件的read()、CQ或零拷贝的等待者，
+// 并记下该文件待唤醒。res非0表示该描述符被中止，整次传输以res结束。槽位本身不在这里回收；调用者需持有ring_lock
+static void mydma_complete_desc_locked(struct mydma_queue *q, u32 slot, int res)
+{
+    struct mydma_dev *priv_dev = q->priv_dev;
+    struct dma_context *ctx = &q->dma_ctx_ring[slot];
+    struct mydma_buf *b = ctx->buf;
 
-    if (priv_dev->ring_buffer_virt_addr) {
-        dma_free_coherent(&pdev->dev, priv_dev->ring_buffer_size, priv_dev->ring_buffer_virt_addr, priv_dev->ring_buffer_dma_addr);
+    ctx->buf = NULL;
+    ctx->state = MYDMA_SLOT_DONE;
+    if (!b) {
+        mydma_inline_done_locked(q, slot, res);
+        return;
     }
-
-    if (priv_dev->bar0_virt_addr) {
-        pci_iounmap(pdev, priv_dev->bar0_virt_addr);
+    if (!res && b->crc_check == MYDMA_CRC_HW) {
+        dma_rmb(); // 先看到status，再读设备回写的CRC
+        if (READ_ONCE(q->ring_desc64[slot].crc) != b->crc) {
+            mydma_stat_inc(priv_dev, crc_errors);
+            res = -EBADMSG;
+        }
     }
+    if (res) b->res = res;
 
-    pci_release_regions(pdev);
-    pci_disable_device(pdev);
-    pr_info("mydma: device removed successfully\n");
-}
+    // 一次传输的全部描述符都完成后才算完成，各描述符可以按任意顺序完成
+    if (--b->pending) return;
+    mydma_account_locked(q, slot, b->len, b->res);
 
+    if (b->src) {
+        // 异地传输的输入缓冲区与输出缓冲区同时释放
+        mydma_buf_release_locked(q, b->src);
+        b->src = NULL;
+    }
+    if (b->dst) {
+        mydma_buf_release_locked(q, b->dst);
+        b->dst = NULL;
+    }
 
-// --- 6. Module Init/Exit ---
-static int __init mydma_init(void)
+    if (b->direct) {
+        // 唤醒同步等待的write()；已放弃等待的由mydma_direct_gc()释放
+        b->state = MYDMA_BUF_DONE;
+        mydma_file_mark_locked(q, b->file);
+        return;
+    }
+
+    if (b->orphan) {
+        // 持有者已关闭文件，没有人会来取结果
+        mydma_buf_release_locked(q, b);
+        return;
+    }
+    if (b->uring) {
+        // 经共享提交队列提交的缓冲区投递CQE后重新归用户所有；CQ已满时退化为等待MYDMA_IOC_COMPLETE
+        b->uring = false;
+        if (mydma_uring_post_cqe_locked(b->owner->uring, b - priv_dev->pool_bufs, b->len, b->res, b->user_data)) {
+            b->state = MYDMA_BUF_OWNED;
+            b->res = 0;
+            mydma_file_mark_locked(q, b->file);
+            return;
+        }
+    }
+    b->state = MYDMA_BUF_DONE;
+    if (!b->owner) {
+        // write()提交的缓冲区按完成顺序进入发起文件的FIFO，等待它的read()取走
+        b->file->done_fifo[(b->file->done_head + b->file->done_count) % b->file->done_size] = b - priv_dev->pool_bufs;
+        b->file->done_count++;
+    }
+    mydma_file_mark_locked(q, b->file);
+}
+
+// 队列头之后是否有乱序完成、尚未投递的描述符。只有desc_poll模式下每个槽位有自己的完成标志；
+// 不持锁也可以调用，此时结果只是提示，真正的回收在ring_lock下重新检查
+static bool mydma_ooo_pending(struct mydma_queue *q)
+{
+    u32 head = READ_ONCE(q->queue_head);
+    u32 tail = smp_load_acquire(&q->queue_tail);
+    u32 slot, n;
+
+    if (!desc_poll || head == tail) return false;
+    for (slot = (head + 1) & q->ring_mask, n = 0; slot != tail && n < MYDMA_REAP_SCAN;
+         slot = (slot + 1) & q->ring_mask, n++) {
+        if (READ_ONCE(q->dma_ctx_ring[slot].state) == MYDMA_SLOT_INFLIGHT && mydma_desc_is_done(q, slot))
+            return true;
+    }
+    return false;
+}
+
+// 回收硬件已处理完毕的描述符：推进queue_head，并把完成的缓冲区交给read()、CQ或零拷贝的等待者；调用者需持有ring_lock。
+// 最多投递budget个，返回实际投递的个数。先按顺序回收队列头的描述符；队列头未完成时再向后查看，乱序完成的描述符立即投递完成事件，
+// 不必等前面慢的描述符，它们的槽位置为DONE，等前面的全部完成后随队列头一起按顺序回收
+static u32 mydma_reap_budget_locked(struct mydma_queue *q, u32 budget)
+{
+    struct mydma_dev *priv_dev = q->priv_dev;
+    struct dma_context *ctx;
+    u32 reaped = 0, freed = 0, slot, tail, skipped;
+
+    while (reaped < budget && mydma_desc_done_locked(q)) {
+        slot = q->queue_head;
+        ctx = &q->dma_ctx_ring[slot];
+
+        if (ctx->state != MYDMA_SLOT_DONE) {
+            // 安全检查：确保硬件头指针越过的描述符确实已完成
+            if (!mydma_desc_is_done(q, slot)) {
+                dev_err_ratelimited(priv_dev->dev, "DMA descriptor %u still not done after head advanced!\n", slot);
+                break;
+            }
+            mydma_complete_desc_locked(q, slot, 0);
+            reaped++;
+        }
+
+        ctx->size = 0;
+        ctx->state = MYDMA_SLOT_FREE;
+        // 凭done标志位完成的描述符，硬件头指针至少也已越过它，影子副本随之前进
+        if (q->hw_head_shadow == q->queue_head)
+            q->hw_head_shadow = (q->queue_head + 1) & q->ring_mask;
+        // 先释放槽位再推进头指针，与提交者保留槽位时的acquire读配对
+        smp_store_release(&q->queue_head, (q->queue_head + 1) & q->ring_mask);
+        freed++;
+    }
+
+    // 队列头被未完成的描述符挡住：投递其后已完成的描述符，最多越过MYDMA_REAP_SCAN个仍在途的描述符
+    tail = smp_load_acquire(&q->queue_tail);
+    if (desc_poll && reaped < budget && q->queue_head != tail) {
+        skipped = 1;
+        for (slot = (q->queue_head + 1) & q->ring_mask; slot != tail && reaped < budget && skipped < MYDMA_REAP_SCAN;
+             slot = (slot + 1) & q->ring_mask) {
+            if (q->dma_ctx_ring[slot].state == MYDMA_SLOT_DONE) continue;
+            if (!mydma_desc_is_done(q, slot)) { skipped++; continue; }
+            mydma_complete_desc_locked(q, slot, 0);
+            reaped++;
+        }
+    }
+
+    if (reaped) {
+        rmb(); // 读内存屏障，确保先读取done标志位，再访问DMA缓冲区内容
+        mydma_wake_files_locked(q);
+    }
+    if (reaped || freed)
+        mydma_wake_space(q); // 腾出了槽位或缓冲区，无论在中断线程还是进程上下文中回收都要唤醒写者
+    return reaped;
+}
+
+// 进程上下文中不限预算，回收全部已完成的描述符
+static void mydma_reap_locked(struct mydma_queue *q)
+{
+    mydma_reap_budget_locked(q, U32_MAX);
+}
+
+// 从本文件的完成FIFO中取出最早完成的write()：缓冲区传输时*b为该缓冲区，内联传输时*b为NULL、结果拷贝到*inl。
+// FIFO为空时返回false；调用者需持有ring_lock
+static bool mydma_pop_done_locked(struct mydma_file *f, struct mydma_buf **b, struct mydma_inline_done *inl)
+{
+    u32 idx;
+
+    if (!f->done_count) return false;
+    idx = f->done_fifo[f->done_head];
+    f->done_head = (f->done_head + 1) % f->done_size;
+    f->done_count--;
+    if (idx == MYDMA_DONE_INLINE) {
+        *b = NULL;
+        *inl = f->inline_done[f->inline_head];
+        f->inline_head = (f->inline_head + 1) % f->q->nr_bufs;
+        f->inline_count--;
+    } else {
+        *b = &f->priv_dev->pool_bufs[idx];
+    }
+    return true;
+}
+
+// 回收已完成的描述符，并取出本文件最早完成的write()；其他文件的完成事件留在它们各自的FIFO中
+static bool mydma_pop_done(struct mydma_file *f, struct mydma_buf **b, struct mydma_inline_done *inl)
+{
+    struct mydma_queue *q = f->q;
+    bool found;
+
+    spin_lock(&q->ring_lock);
+    mydma_reap_locked(q);
+    found = mydma_pop_done_locked(f, b, inl);
+    spin_unlock(&q->ring_lock);
+    return found;
+}
+
+// 回收已完成的描述符，并检查零拷贝缓冲区是否已完成。用作等待条件，设备正在解绑时也返回true，
+// 调用者再按缓冲区的状态区分
+static bool mydma_buf_done(struct mydma_queue *q, struct mydma_buf *b)
+{
+    bool done;
+
+    if (READ_ONCE(q->priv_dev->dying)) return true;
+    spin_lock(&q->ring_lock);
+    mydma_reap_locked(q);
+    done = b->state == MYDMA_BUF_DONE;
+    spin_unlock(&q->ring_lock);
+    return done;
+}
+
+// 推算bytes字节在本队列上传输完所需的毫秒数：按测得的吞吐量放宽MYDMA_TIMEOUT_SLACK倍，
+// 限制在[MYDMA_TIMEOUT_MIN_MS, MYDMA_WAIT_TIMEOUT_MS]内；还没有测量值时取上限
+static u32 mydma_expected_ms(struct mydma_queue *q, u64 bytes)
+{
+    u64 rate = READ_ONCE(q->xfer_rate);
+
+    if (!rate) return MYDMA_WAIT_TIMEOUT_MS;
+    return min_t(u64, MYDMA_TIMEOUT_MIN_MS + div64_u64(bytes * MYDMA_TIMEOUT_SLACK, rate), MYDMA_WAIT_TIMEOUT_MS);
+}
+
+// 等待len字节的传输完成的超时(jiffies)：文件设置了MYDMA_OPT_TIMEOUT_MS时用它，否则把排在前面的在途描述符
+// 按最大长度计入，与len一起推算。等待任意一个完成或空闲槽位时len为0，只看前面的在途描述符
+static long mydma_wait_timeout(struct mydma_file *mfile, u32 len)
+{
+    struct mydma_queue *q = mfile->q;
+    u32 ahead;
+
+    if (mfile->timeout_ms) return msecs_to_jiffies(mfile->timeout_ms);
+    ahead = (atomic_read(&q->res_tail) - READ_ONCE(q->queue_head)) & q->ring_mask;
+    return msecs_to_jiffies(mydma_expected_ms(q, (u64)ahead * MYDMA_DESC_MAX_LEN + len));
+}
+
+// 队列上没有已保留或在途的描述符
+static bool mydma_queue_idle(struct mydma_queue *q)
+{
+    return (atomic_read(&q->res_tail) & ~MYDMA_RES_STOPPED) == READ_ONCE(q->queue_head);
+}
+
+static void mydma_pm_put(struct mydma_queue *q)
+{
+    if (atomic_dec_and_test(&q->pm_users))
+        schedule_delayed_work(&q->pm_idle, msecs_to_jiffies(MYDMA_PM_IDLE_MS));
+}
+
+// 访问设备之前调用：队列已持有设备引用时只是一次原子加，否则唤醒设备(可能睡眠)
+static int mydma_pm_get(struct mydma_queue *q)
+{
+    struct device *dev = q->priv_dev->dev;
+    int ret = 0;
+
+    atomic_inc(&q->pm_users);
+    smp_mb__after_atomic(); // 与mydma_queue_pm_idle()中的smp_mb()配对
+    if (likely(READ_ONCE(q->pm_held))) return 0;
+
+    mutex_lock(&q->pm_lock);
+    if (!q->pm_held) {
+        ret = pm_runtime_resume_and_get(dev);
+        if (ret < 0) dev_err(dev, "Runtime resume failed: %d\n", ret);
+        else WRITE_ONCE(q->pm_held, true);
+    }
+    mutex_unlock(&q->pm_lock);
+    if (ret < 0) mydma_pm_put(q);
+    return ret < 0 ? ret : 0;
+}
+
+// 同上，但不为此唤醒已挂起的设备：忙轮询只在队列已持有设备引用时进行
+static bool mydma_pm_get_active(struct mydma_queue *q)
+{
+    atomic_inc(&q->pm_users);
+    smp_mb__after_atomic();
+    if (likely(READ_ONCE(q->pm_held))) return true;
+    mydma_pm_put(q);
+    return false;
+}
+
+// 队列空闲时释放它持有的设备引用，所有队列都释放后设备按autosuspend延迟挂起；仍有在途描述符时稍后再看
+static void mydma_queue_pm_idle(struct work_struct *work)
+{
+    struct mydma_queue *q = container_of(to_delayed_work(work), struct mydma_queue, pm_idle);
+    struct device *dev = q->priv_dev->dev;
+
+    mutex_lock(&q->pm_lock);
+    if (!q->pm_held || atomic_read(&q->pm_users)) goto out;
+    if (!mydma_queue_idle(q)) {
+        schedule_delayed_work(&q->pm_idle, msecs_to_jiffies(MYDMA_PM_IDLE_MS));
+        goto out;
+    }
+
+    // 先清除pm_held再检查提交者：与mydma_pm_get()相互看得到对方，其间进来的提交者让队列继续持有引用
+    WRITE_ONCE(q->pm_held, false);
+    smp_mb();
+    if (atomic_read(&q->pm_users)) {
+        WRITE_ONCE(q->pm_held, true);
+        goto out;
+    }
+    pm_runtime_mark_last_busy(dev);
+    pm_runtime_put_autosuspend(dev);
+out:
+    mutex_unlock(&q->pm_lock);
+}
+
+// 开始忙轮询：第一个轮询者屏蔽该队列的中断，完成由轮询者在进程上下文中回收
+static void mydma_poll_enter(struct mydma_queue *q)
+{
+    if (atomic_inc_return(&q->pollers) == 1)
+        writel(0, q->regs + MYDMA_REG_INT_ENABLE);
+}
+
+// 结束忙轮询：最后一个轮询者重新打开中断，并回收屏蔽期间完成、可能不会再触发中断的描述符
+static void mydma_poll_exit(struct mydma_queue *q)
+{
+    if (!atomic_dec_and_test(&q->pollers)) return;
+    writel(1, q->regs + MYDMA_REG_INT_ENABLE);
+    readl(q->regs + MYDMA_REG_INT_ENABLE); // 刷新posted写，确保中断已打开再检查
+
+    spin_lock(&q->ring_lock);
+    mydma_reap_locked(q);
+    spin_unlock(&q->ring_lock);
+}
+
+// 忙轮询的一步：不持锁地看一眼队列头及其后的描述符，有已完成的才获取ring_lock回收。
+// 中断被屏蔽期间轮询者代替中断线程回收，回收路径照常唤醒收到完成事件的其他文件
+static void mydma_poll_reap(struct mydma_queue *q)
+{
+    u32 head = READ_ONCE(q->queue_head);
+
+    if (head == smp_load_acquire(&q->queue_tail)) return;
+    if (!mydma_desc_is_done(q, head) && !mydma_ooo_pending(q)) return;
+
+    spin_lock(&q->ring_lock);
+    mydma_reap_locked(q);
+    spin_unlock(&q->ring_lock);
+}
+
+// 混合轮询：在usecs微秒内自旋等待cond成立，省去中断、唤醒和调度带来的几十微秒延迟；
+// 超时、需要让出CPU或有信号时放弃，返回cond是否成立，不成立时由调用者退回等待队列。cond应当足够廉价。
+// 设备已运行时挂起时不轮询，直接返回false
+#define mydma_busy_poll(q, usecs, cond)                                           \
+({                                                                                \
+    u64 __end = ktime_get_ns() + (u64)(usecs) * NSEC_PER_USEC;                    \
+    bool __done = false;                                                          \
+                                                                                  \
+    if (mydma_pm_get_active(q)) {                                                 \
+        mydma_poll_enter(q);                                                      \
+        while (!(__done = (cond)) && ktime_get_ns() < __end &&                    \
+               !need_resched() && !signal_pending(current)) {                     \
+            mydma_poll_reap(q);                                                   \
+            cpu_relax();                                                          \
+        }                                                                         \
+        mydma_poll_exit(q);                                                       \
+        mydma_pm_put(q);                                                          \
+    }                                                                             \
+    __done;                                                                       \
+})
+
+// 查找当前文件通过零拷贝接口持有的缓冲区；调用者需持有ring_lock
+static struct mydma_buf *mydma_file_buf_locked(struct mydma_file *mfile, u32 idx)
+{
+    struct mydma_dev *priv_dev = mfile->priv_dev;
+
+    if (idx >= priv_dev->pool_nr_bufs) return NULL;
+    if (priv_dev->pool_bufs[idx].owner != mfile) return NULL;
+    return &priv_dev->pool_bufs[idx];
+}
+
+static void mydma_uring_free(struct mydma_uring *ur)
+{
+    if (!ur) return;
+    vfree(ur->region);
+    kfree(ur);
+}
+
+// 为文件创建共享提交/完成队列，布局通过mydma_uring_params返回给用户
+static int mydma_uring_setup(struct mydma_file *mfile, void __user *argp)
+{
+    struct mydma_queue *q = mfile->q;
+    struct mydma_uring_params p;
+    struct mydma_uring *ur;
+    int ret = 0;
+
+    if (copy_from_user(&p, argp, sizeof(p))) return -EFAULT;
+    if (p.sq_entries > MYDMA_URING_MAX_ENTRIES) return -EINVAL;
+
+    ur = kzalloc(sizeof(*ur), GFP_KERNEL);
+    if (!ur) return -ENOMEM;
+
+    // SQ深度默认与队列的缓冲池分片大小一致；CQ为SQ的两倍，减少用户消费不及时导致的溢出
+    ur->sq_entries = roundup_pow_of_two(p.sq_entries ? p.sq_entries : q->nr_bufs);
+    ur->sq_entries = min_t(u32, ur->sq_entries, MYDMA_URING_MAX_ENTRIES);
+    ur->cq_entries = 2 * ur->sq_entries;
+
+    // sq_head/sq_tail/cq_head/cq_tail各占一个缓存行，避免生产者与消费者伪共享；
+    // cq_overflow与cq_tail同样由内核写，放在同一行；随后依次是SQE数组和CQE数组
+    memset(&p, 0, sizeof(p));
+    p.sq_entries = ur->sq_entries;
+    p.cq_entries = ur->cq_entries;
+    p.sq_head_off = 0;
+    p.sq_tail_off = SMP_CACHE_BYTES;
+    p.cq_head_off = 2 * SMP_CACHE_BYTES;
+    p.cq_tail_off = 3 * SMP_CACHE_BYTES;
+    p.cq_overflow_off = p.cq_tail_off + sizeof(u32);
+    p.sqes_off = 4 * SMP_CACHE_BYTES;
+    p.cqes_off = ALIGN(p.sqes_off + ur->sq_entries * sizeof(struct mydma_sqe), SMP_CACHE_BYTES);
+    p.region_size = PAGE_ALIGN(p.cqes_off + ur->cq_entries * sizeof(struct mydma_cqe));
+
+    ur->region = vmalloc_user(p.region_size);
+    if (!ur->region) { kfree(ur); return -ENOMEM; }
+    ur->region_size = p.region_size;
+    ur->sq_head = ur->region + p.sq_head_off;
+    ur->sq_tail = ur->region + p.sq_tail_off;
+    ur->cq_head = ur->region + p.cq_head_off;
+    ur->cq_tail = ur->region + p.cq_tail_off;
+    ur->cq_overflow = ur->region + p.cq_overflow_off;
+    ur->sqes = ur->region + p.sqes_off;
+    ur->cqes = ur->region + p.cqes_off;
+
+    if (copy_to_user(argp, &p, sizeof(p))) { ret = -EFAULT; goto err_free; }
+
+    spin_lock(&q->ring_lock);
+    if (mfile->uring) ret = -EBUSY;
+    else mfile->uring = ur;
+    spin_unlock(&q->ring_lock);
+    if (ret) goto err_free;
+
+    dev_dbg(mfile->priv_dev->dev, "uring set up, sq_entries=%u cq_entries=%u\n", ur->sq_entries, ur->cq_entries);
+    return 0;
+
+err_free:
+    mydma_uring_free(ur);
+    return ret;
+}
+
+// 消费SQ中最多to_submit个SQE并提交给硬件，返回消费的SQE个数；调用者需持有ring_lock
+static u32 mydma_uring_submit_locked(struct mydma_file *mfile, struct mydma_uring *ur, u32 to_submit)
+{
+    struct mydma_queue *q = mfile->q;
+    const struct mydma_sqe *sqe;
+    struct mydma_buf *b;
+    u32 head = ur->sq_head_k;
+    u32 tail, nr, i, slot, queued = 0;
+    u32 buf, len;
+    u64 user_data;
+
+    // 与用户侧对sq_tail的release写配对，保证读到完整的SQE
+    tail = smp_load_acquire(ur->sq_tail);
+    nr = min(tail - head, to_submit);
+    nr = min(nr, ur->sq_entries); // 用户写坏的sq_tail不能让内核越界
+
+    for (i = 0; i < nr; i++, head++) {
+        sqe = &ur->sqes[head & (ur->sq_entries - 1)];
+        buf = READ_ONCE(sqe->buf);
+        len = READ_ONCE(sqe->len);
+        user_data = READ_ONCE(sqe->user_data);
+
+        b = mydma_file_buf_locked(mfile, buf);
+        if (!b || b->state == MYDMA_BUF_INFLIGHT || len == 0 || len > MYDMA_POOL_BUF_SIZE) {
+            // 非法SQE直接以错误码完成，不阻塞后续SQE
+            mydma_uring_post_cqe_locked(ur, buf, 0, -EINVAL, user_data);
+            continue;
+        }
+
+        // 硬件队列已满：剩余SQE留在SQ中，下次门铃时再提交
+        if (!mydma_slots_reserve_locked(q, 1, 1, &slot)) break;
+
+        b->uring = true;
+        b->user_data = user_data;
+        mydma_queue_desc(q, slot, b, len);
+        queued++;
+    }
+
+    // 本次消费的所有SQE只对应一次尾指针写
+    if (queued) mydma_ring_doorbell(q);
+
+    ur->sq_head_k = head;
+    smp_store_release(ur->sq_head, head);
+    return i;
+}
+
+// 回收已完成的描述符，并返回CQ中尚未被用户消费的CQE个数
+static u32 mydma_uring_cq_ready(struct mydma_file *mfile, struct mydma_uring *ur)
+{
+    struct mydma_queue *q = mfile->q;
+    u32 ready;
+
+    spin_lock(&q->ring_lock);
+    mydma_reap_locked(q);
+    ready = ur->cq_tail_k - READ_ONCE(*ur->cq_head);
+    spin_unlock(&q->ring_lock);
+    return ready;
+}
+
+// 门铃：提交SQ中的SQE，并可选地等待CQ中积累到min_complete个完成事件
+static long mydma_uring_enter(struct mydma_file *mfile, void __user *argp)
+{
+    struct mydma_queue *q = mfile->q;
+    struct mydma_uring_enter e;
+    struct mydma_uring *ur;
+    long timeout;
+    u32 submitted = 0;
+
+    if (copy_from_user(&e, argp, sizeof(e))) return -EFAULT;
+
+    spin_lock(&q->ring_lock);
+    ur = mfile->uring;
+    if (ur) submitted = mydma_uring_submit_locked(mfile, ur, e.to_submit);
+    spin_unlock(&q->ring_lock);
+    if (!ur) return -EINVAL;
+
+    if (e.min_complete) {
+        e.min_complete = min(e.min_complete, ur->cq_entries);
+        timeout = wait_event_interruptible_timeout(mfile->wait,
+                                                   mydma_uring_cq_ready(mfile, ur) >= e.min_complete ||
+                                                   READ_ONCE(q->priv_dev->dying),
+                                                   mydma_wait_timeout(mfile, 0));
+        // 已经消费了SQE时仍返回消费个数，用户可从CQ判断是否等到了足够的完成
+        if (timeout == 0) mydma_stat_inc(q->priv_dev, timeouts);
+        if (timeout <= 0 && !submitted) return timeout ? timeout : -ETIMEDOUT;
+        if (READ_ONCE(q->priv_dev->dying) && !submitted) return -ENODEV;
+    }
+    return submitted;
+}
+
+// 解除外部dma-buf的映射和pin并释放引用；m中未完成导入的部分为空
+static void mydma_dmabuf_unimport(struct mydma_dmabuf_map *m)
+{
+    if (m->sgt) {
+        dma_resv_lock(m->dmabuf->resv, NULL);
+        dma_buf_unmap_attachment(m->attach, m->sgt, DMA_BIDIRECTIONAL);
+        dma_buf_unpin(m->attach);
+        dma_resv_unlock(m->dmabuf->resv);
+    }
+    if (m->attach) dma_buf_detach(m->dmabuf, m->attach);
+    if (m->dmabuf) dma_buf_put(m->dmabuf);
+}
+
+// 解除直接模式传输的DMA映射(隐含同步给CPU)并解除用户页的固定
+static void mydma_direct_free(struct mydma_dev *priv_dev, struct mydma_direct *d)
+{
+    mydma_dmabuf_unimport(&d->imp[0]);
+    mydma_dmabuf_unimport(&d->imp[1]);
+    if (d->sgt.sgl) {
+        dma_unmap_sgtable(priv_dev->dev, &d->sgt, DMA_BIDIRECTIONAL, 0);
+        sg_free_table(&d->sgt);
+    }
+    if (d->nr_pages > 0)
+        unpin_user_pages_dirty_lock(d->pages, d->nr_pages, true);
+    kvfree(d->pages);
+    kfree(d);
+}
+
+// 释放硬件已完成的(all为true时释放全部)放弃等待的直接模式传输，需在进程上下文调用
+static void mydma_direct_gc(struct mydma_queue *q, bool all)
+{
+    struct mydma_direct *d, *tmp;
+    LIST_HEAD(done);
+
+    spin_lock(&q->ring_lock);
+    list_for_each_entry_safe(d, tmp, &q->direct_orphans, orphan_node) {
+        if (all || d->b.state == MYDMA_BUF_DONE)
+            list_move(&d->orphan_node, &done);
+    }
+    spin_unlock(&q->ring_lock);
+
+    list_for_each_entry_safe(d, tmp, &done, orphan_node)
+        mydma_direct_free(q->priv_dev, d);
+}
+
+// 直接模式等待条件：为一个DMA段保留槽位并排队描述符；环形缓冲区放不下时先把已排队的描述符交给硬件再等待
+// unqueued为尚未排队的描述符个数，已预先计入d->b.pending
+static bool mydma_direct_queue_seg(struct mydma_queue *q, struct mydma_direct *d,
+                                   struct scatterlist *sg, bool last, u32 *unrung, u32 *unqueued)
+{
+    u32 need = mydma_desc_count(sg_dma_len(sg));
+    u32 slot;
+
+    if (!mydma_slots_reserve(q, need, need, &slot)) {
+        if (*unrung) {
+            mydma_ring_doorbell(q);
+            *unrung = 0;
+        }
+        return false;
+    }
+
+    mydma_fill_descs(q, slot, &d->b, sg_dma_address(sg), sg_dma_address(sg), sg_dma_len(sg), last);
+    *unqueued -= need;
+    *unrung += need;
+    if (last) {
+        mydma_ring_doorbell(q);
+        *unrung = 0;
+    }
+    return true;
+}
+
+// 直接模式：固定调用者的用户页，以流式(非一致性)映射直接对用户内存做就地DMA，省去两次拷贝。
+// 硬件释放这些页之前不能解除固定，因此write()同步等待完成，返回时结果已在用户缓冲区中
+static ssize_t mydma_write_direct(struct mydma_file *mfile, const char __user *buf, size_t count)
+{
+    struct mydma_queue *q = mfile->q;
+    struct mydma_dev *priv_dev = q->priv_dev;
+    struct device *dev = priv_dev->dev;
+    unsigned long uaddr = (unsigned long)buf;
+    struct mydma_direct *d;
+    struct scatterlist *sg;
+    u32 unrung = 0, unqueued = 0;
+    int nr_pages, i;
+    long timeout = 1;
+    bool done;
+    int ret;
+
+    // 任意一个DMA段拆出的描述符都必须能一次放进环形缓冲区
+    if (count > (size_t)(priv_dev->ring_size - 1) * MYDMA_DESC_MAX_LEN) {
+        dev_warn(dev, "Direct write size %zu too large for the ring\n", count);
+        return -EINVAL;
+    }
+
+    mydma_direct_gc(q, false);
+
+    nr_pages = DIV_ROUND_UP(offset_in_page(uaddr) + count, PAGE_SIZE);
+    d = kzalloc(sizeof(*d), GFP_KERNEL);
+    if (!d) return -ENOMEM;
+    d->pages = kvmalloc_array(nr_pages, sizeof(struct page *), GFP_KERNEL);
+    if (!d->pages) { ret = -ENOMEM; goto err_free; }
+
+    // 就地操作：设备既读又写这些页，因此需要FOLL_WRITE
+    d->nr_pages = pin_user_pages_fast(uaddr & PAGE_MASK, nr_pages, FOLL_WRITE, d->pages);
+    if (d->nr_pages != nr_pages) { ret = d->nr_pages < 0 ? d->nr_pages : -EFAULT; goto err_free; }
+
+    ret = sg_alloc_table_from_pages(&d->sgt, d->pages, nr_pages, offset_in_page(uaddr), count, GFP_KERNEL);
+    if (ret) goto err_free;
+
+    // 流式映射，映射时已同步给设备(必要时刷写CPU缓存)
+    ret = dma_map_sgtable(dev, &d->sgt, DMA_BIDIRECTIONAL, 0);
+    if (ret) {
+        sg_free_table(&d->sgt);
+        d->sgt.sgl = NULL;
+        goto err_free;
+    }
+
+    // 入队前一次性计入全部描述符，入队时无需持锁更新pending；
+    // 另加一个提交者自己的引用，保证全部描述符入队之前不会被判定为完成
+    for_each_sgtable_dma_sg(&d->sgt, sg, i)
+        unqueued += mydma_desc_count(sg_dma_len(sg));
+    d->b.direct = true;
+    d->b.file = mfile;
+    d->b.len = count;
+    d->b.pending = unqueued + 1;
+    d->b.state = MYDMA_BUF_INFLIGHT;
+    mydma_stat_inc(priv_dev, submitted);
+
+    // 每个DMA段按MYDMA_DESC_MAX_LEN拆分并串联，环形缓冲区满时分批提交
+    for_each_sgtable_dma_sg(&d->sgt, sg, i) {
+        timeout = wait_event_killable_timeout(q->space_wait_queue,
+                                              mydma_direct_queue_seg(q, d, sg, i == d->sgt.nents - 1, &unrung, &unqueued) ||
+                                              READ_ONCE(priv_dev->dying),
+                                              mydma_wait_timeout(mfile, 0));
+        if (timeout <= 0 || READ_ONCE(priv_dev->dying)) break;
+    }
+    if (unrung) mydma_ring_doorbell(q); // 中途失败时也要提交已排队的描述符
+
+    // 去掉未能入队的描述符和提交者自己的引用
+    spin_lock(&q->ring_lock);
+    d->b.pending -= unqueued + 1;
+    if (d->b.pending == 0) d->b.state = MYDMA_BUF_DONE;
+    spin_unlock(&q->ring_lock);
+
+    if (timeout > 0)
+        timeout = wait_event_killable_timeout(mfile->wait,
+                                              mydma_buf_done(q, &d->b),
+                                              mydma_wait_timeout(mfile, count));
+
+    spin_lock(&q->ring_lock);
+    done = d->b.state == MYDMA_BUF_DONE;
+    if (!done) {
+        d->b.file = NULL; // 不再有人等待它的完成事件
+        list_add_tail(&d->orphan_node, &q->direct_orphans);
+    }
+    spin_unlock(&q->ring_lock);
+
+    if (!done) {
+        // 硬件可能仍在访问这些页，留待完成后再释放；没有超时也没有被杀死说明设备正在解绑
+        if (timeout > 0) return -ENODEV;
+        if (timeout == 0) mydma_stat_inc(priv_dev, timeouts);
+        dev_err(dev, "Direct write %s!\n", timeout == 0 ? "timeout" : "killed");
+        return timeout == 0 ? -ETIMEDOUT : timeout;
+    }
+
+    ret = d->b.res;
+    mydma_direct_free(priv_dev, d);
+    if (ret) return ret;
+    // 部分段未能提交时数据并不完整
+    return timeout > 0 ? count : (timeout == 0 ? -ETIMEDOUT : timeout);
+
+err_free:
+    mydma_direct_free(priv_dev, d);
+    return ret;
+}
+
+// MYDMA_OPT_PRIORITY：换到对应优先级的队列，高优先级文件按当前CPU在保留的队列之间分配
+static int mydma_file_set_prio(struct mydma_file *mfile, u64 val)
+{
+    struct mydma_dev *priv_dev = mfile->priv_dev;
+    u32 cpu = raw_smp_processor_id();
+    u32 qid;
+
+    if (val > 1) return -EINVAL;
+    if (val && !priv_dev->nr_hiprio) return -EOPNOTSUPP;
+    if (val == mfile->q->hiprio) return 0;
+    // 旧队列上的缓冲区、共享队列和在途传输都不会跟着换过去
+    if (READ_ONCE(mfile->q_used)) return -EBUSY;
+
+    if (val) qid = priv_dev->nr_queues - priv_dev->nr_hiprio + cpu % priv_dev->nr_hiprio;
+    else qid = priv_dev->cpu_queue[cpu];
+    mfile->q = &priv_dev->queues[qid];
+    return 0;
+}
+
+// MYDMA_IOC_SET_OPT / MYDMA_IOC_GET_OPT
+static long mydma_file_opt(struct mydma_file *mfile, unsigned int cmd, void __user *argp)
+{
+    struct mydma_opt opt;
+
+    if (copy_from_user(&opt, argp, sizeof(opt))) return -EFAULT;
+
+    switch (opt.opt) {
+    case MYDMA_OPT_DIRECT_MIN:
+        if (cmd == MYDMA_IOC_GET_OPT) { opt.val = mfile->direct_min; break; }
+        if (opt.val > U32_MAX) return -EINVAL;
+        mfile->direct_min = opt.val;
+        return 0;
+    case MYDMA_OPT_TAGGED:
+        if (cmd == MYDMA_IOC_GET_OPT) { opt.val = mfile->tagged; break; }
+        if (opt.val > 1) return -EINVAL;
+        mfile->tagged = opt.val;
+        return 0;
+    case MYDMA_OPT_POLL_USECS:
+        if (cmd == MYDMA_IOC_GET_OPT) { opt.val = mfile->poll_usecs; break; }
+        if (opt.val > MYDMA_POLL_MAX_USECS) return -EINVAL;
+        mfile->poll_usecs = opt.val;
+        return 0;
+    case MYDMA_OPT_TIMEOUT_MS:
+        if (cmd == MYDMA_IOC_GET_OPT) { opt.val = mfile->timeout_ms; break; }
+        if (opt.val > MYDMA_TIMEOUT_MAX_MS) return -EINVAL;
+        mfile->timeout_ms = opt.val;
+        return 0;
+    case MYDMA_OPT_PRIORITY:
+        if (cmd == MYDMA_IOC_GET_OPT) { opt.val = mfile->q->hiprio; break; }
+        return mydma_file_set_prio(mfile, opt.val);
+    case MYDMA_OPT_CRC32C:
+        if (cmd == MYDMA_IOC_GET_OPT) { opt.val = mfile->crc; break; }
+        if (opt.val > 1) return -EINVAL;
+        mfile->crc = opt.val;
+        return 0;
+    default:
+        return -EINVAL;
+    }
+
+    return copy_to_user(argp, &opt, sizeof(opt)) ? -EFAULT : 0;
+}
+
+// 文件操作的入口：设备正在解绑时返回-ENODEV，否则进入SRCU读侧，由mydma_fop_exit()退出。
+// 解绑设置dying之后等待所有读侧退出，再释放寄存器映射、环形缓冲区和缓冲池
+static int mydma_fop_enter(struct mydma_dev *priv_dev, int *idx)
+{
+    *idx = srcu_read_lock(&priv_dev->srcu);
+    if (!READ_ONCE(priv_dev->dying)) return 0;
+    srcu_read_unlock(&priv_dev->srcu, *idx);
+    return -ENODEV;
+}
+
+static void mydma_fop_exit(struct mydma_dev *priv_dev, int idx)
+{
+    srcu_read_unlock(&priv_dev->srcu, idx);
+}
+
+static int mydma_open(struct inode *inode, struct file *filp)
+{
+    struct mydma_dev *priv_dev;
+    struct mydma_file *mfile;
+    int ret = -ENOMEM;
+
+    // 按次设备号找到设备并取得引用；解绑时先摘除次设备号，之后的open()找不到它
+    mutex_lock(&mydma_minor_lock);
+    priv_dev = idr_find(&mydma_minor_idr, iminor(inode));
+    if (priv_dev) kref_get(&priv_dev->ref);
+    mutex_unlock(&mydma_minor_lock);
+    if (!priv_dev) return -ENODEV;
+
+    mfile = kzalloc_node(sizeof(*mfile), GFP_KERNEL, dev_to_node(priv_dev->dev));
+    if (!mfile) goto err_put;
+    mfile->priv_dev = priv_dev;
+    mfile->filp = filp;
+    INIT_LIST_HEAD(&mfile->wake_node);
+    init_waitqueue_head(&mfile->wait);
+    mutex_init(&mfile->map_lock);
+
+    // 绑定到当前CPU对应的队列，同一CPU上的线程共享一个队列，不同CPU之间的提交互不竞争
+    mfile->q = &priv_dev->queues[priv_dev->cpu_queue[raw_smp_processor_id()]];
+
+    // 完成FIFO按一个队列的缓冲池分片定容；各队列的分片一样大，MYDMA_OPT_PRIORITY换队列后仍然够用
+    mfile->done_size = priv_dev->inline_max ? 2 * mfile->q->nr_bufs : mfile->q->nr_bufs;
+    mfile->done_fifo = kvcalloc(mfile->done_size, sizeof(u32), GFP_KERNEL);
+    if (priv_dev->inline_max)
+        mfile->inline_done = kvcalloc(mfile->q->nr_bufs, sizeof(struct mydma_inline_done), GFP_KERNEL);
+    if (!mfile->done_fifo || (priv_dev->inline_max && !mfile->inline_done)) goto err_free;
+
+    // 有打开的文件时不允许修改环形缓冲区深度
+    mutex_lock(&priv_dev->cfg_lock);
+    if (priv_dev->dying) {
+        ret = -ENODEV;
+    } else {
+        priv_dev->nr_open++;
+        list_add_tail(&mfile->node, &priv_dev->files);
+        ret = 0;
+    }
+    mutex_unlock(&priv_dev->cfg_lock);
+    if (ret) goto err_free;
+
+    filp->private_data = mfile;
+    dev_dbg(priv_dev->dev, "open(), queue %u\n", mfile->q->qid);
+    return 0;
+
+err_free:
+    kvfree(mfile->done_fifo);
+    kvfree(mfile->inline_done);
+    kfree(mfile);
+err_put:
+    mydma_dev_put(priv_dev);
+    return ret;
+}
+
+static int mydma_release(struct inode *inode, struct file *filp)
+{
+    struct mydma_file *mfile = filp->private_data;
+    struct mydma_dev *priv_dev = mfile->priv_dev;
+    struct mydma_queue *q = mfile->q;
+    struct mydma_inline_done inl;
+    struct mydma_uring *ur;
+    struct mydma_buf *b;
+    u32 i;
+
+    // 设备已解绑时中断、缓冲池和环形缓冲区都已释放，只需释放文件自己的资源；
+    // 持有cfg_lock，解绑不会在中途释放它们。在此之前中断线程仍可能完成本文件的传输，必须先摘掉本文件的引用
+    mutex_lock(&priv_dev->cfg_lock);
+    spin_lock(&q->ring_lock);
+    if (priv_dev->torn_down) goto out_unlock;
+
+    // 归还该文件持有的零拷贝缓冲区；仍在硬件中的缓冲区标记为孤儿，完成后由回收路径释放。
+    // write()提交、还没完成的缓冲区同样成为孤儿，已完成、没来得及read()的随完成FIFO一起归还，不会被别的文件读到
+    for (i = q->buf_base; i < q->buf_base + q->nr_bufs; i++) {
+        b = &priv_dev->pool_bufs[i];
+        if (b->file != mfile) continue;
+        b->file = NULL;
+        if (b->owner != mfile) {
+            if (b->state == MYDMA_BUF_INFLIGHT) b->orphan = true;
+        } else if (b->state == MYDMA_BUF_INFLIGHT || b->exports) {
+            b->owner = NULL;
+            b->orphan = true;
+        } else {
+            mydma_buf_put_locked(q, b);
+        }
+    }
+    while (mydma_pop_done_locked(mfile, &b, &inl)) {
+        if (b) {
+            mydma_buf_put_locked(q, b);
+        } else {
+            atomic_dec(&q->inline_nr);
+            mydma_wake_space(q);
+        }
+    }
+    // 在途的内联传输完成时丢弃结果
+    if (priv_dev->inline_max) {
+        for (i = 0; i < q->ring_size; i++) {
+            if (q->dma_ctx_ring[i].file == mfile) q->dma_ctx_ring[i].file = NULL;
+        }
+    }
+
+out_unlock:
+    list_del_init(&mfile->wake_node);
+    ur = mfile->uring;
+    mfile->uring = NULL;
+    spin_unlock(&q->ring_lock);
+    priv_dev->nr_open--;
+    list_del(&mfile->node);
+    mutex_unlock(&priv_dev->cfg_lock);
+
+    mydma_uring_free(ur);
+    kvfree(mfile->done_fifo);
+    kvfree(mfile->inline_done);
+    kfree(mfile);
+    dev_dbg(priv_dev->dev, "release()\n");
+    mydma_dev_put(priv_dev);
+    return 0;
+}
+
+// 从用户空间拷贝len字节到缓冲池，按页分块，每块拷贝完趁数据还在缓存中接着算CRC32C，不必再遍历一遍。返回0或-EFAULT
+static int mydma_copy_in_crc(void *dst, const char __user *src, size_t len, u32 *crc)
+{
+    size_t n;
+
+    *crc = ~0U;
+    while (len) {
+        n = min_t(size_t, len, PAGE_SIZE);
+        if (copy_from_user(dst, src, n)) return -EFAULT;
+        *crc = crc32c(*crc, dst, n);
+        dst += n;
+        src += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// 把缓冲区中len字节的结果的前copy_len字节拷贝到用户空间，同样按页分块边拷贝边算CRC32C；
+// 用户只读了一部分时，其余部分只计算不拷贝。返回未能拷贝的字节数
+static unsigned long mydma_copy_out_crc(char __user *dst, const void *src, size_t copy_len, size_t len, u32 *crc)
+{
+    size_t n;
+
+    *crc = ~0U;
+    while (len) {
+        n = min_t(size_t, len, PAGE_SIZE);
+        if (copy_len) {
+            n = min(n, copy_len);
+            if (copy_to_user(dst, src, n)) return copy_len;
+            dst += n;
+            copy_len -= n;
+        }
+        *crc = crc32c(*crc, src, n);
+        src += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static ssize_t mydma_do_read(struct file *filp, char __user *buf, size_t count)
+{
+    struct mydma_file *mfile = filp->private_data;
+    struct mydma_dev *priv_dev = mfile->priv_dev;
+    struct mydma_queue *q = mfile->q;
+    struct mydma_completion comp;
+    struct mydma_inline_done inl;
+    struct mydma_buf *b;
+    long timeout;
+    int ret, res;
+    size_t hdr_len = mfile->tagged ? sizeof(comp) : 0;
+    size_t bytes_to_copy;
+    bool found;
+    void *data;
+    u32 len, crc;
+
+    // 带标签模式下每次read()至少要放得下完成事件头
+    if (mfile->tagged && count < sizeof(comp)) return -EINVAL;
+
+    found = mydma_pop_done(mfile, &b, &inl);
+    if (!found && (filp->f_flags & O_NONBLOCK)) return -EAGAIN;
+
+    // 混合轮询：先自旋一小段时间，仍未完成再睡眠
+    if (!found && mfile->poll_usecs)
+        mydma_busy_poll(q, mfile->poll_usecs, READ_ONCE(mfile->done_count) && (found = mydma_pop_done(mfile, &b, &inl)));
+
+    // 没有已完成的任务，需要等待
+    if (!found) {
+        // 在本文件的等待队列上休眠，直到有本文件的传输完成或超时；唤醒条件中直接取出已完成的传输
+        timeout = wait_event_interruptible_timeout(
+                      mfile->wait,
+                      (found = mydma_pop_done(mfile, &b, &inl)) || READ_ONCE(priv_dev->dying),
+                      mydma_wait_timeout(mfile, 0)
+                  );
+        if (timeout == 0) {
+            mydma_stat_inc(priv_dev, timeouts);
+            dev_err(priv_dev->dev, "Read timeout!\n");
+            return -ETIMEDOUT;
+        }
+        if (timeout < 0) { dev_err(priv_dev->dev, "Read interrupted!\n"); return timeout; }
+        if (!found) return -ENODEV;
+    }
+
+    // 内联传输的结果已经从描述符拷贝到inl中
+    data = b ? b->virt_addr : inl.data;
+    len = b ? b->len : inl.len;
+    res = b ? b->res : inl.res;
+
+    bytes_to_copy = min(count - hdr_len, (size_t)len);
+
+    // 将DMA完成的数据从内核空间拷贝到用户空间；设备没有校验的传输在拷贝的同时校验CRC32C
+    if (b && b->crc_check == MYDMA_CRC_SW) {
+        ret = mydma_copy_out_crc(buf + hdr_len, data, bytes_to_copy, len, &crc);
+        if (!ret && !res && crc != b->crc) {
+            mydma_stat_inc(priv_dev, crc_errors);
+            res = -EBADMSG;
+        }
+    } else {
+        ret = copy_to_user(buf + hdr_len, data, bytes_to_copy);
+    }
+
+    // 带标签模式：完成事件头在数据之前，校验完数据才知道res，所以最后写
+    if (!ret && mfile->tagged) {
+        comp.tag = b ? b->user_data : inl.user_data;
+        comp.len = len;
+        comp.res = res;
+        ret = copy_to_user(buf, &comp, sizeof(comp));
+    }
+    if (ret) {
+        dev_err(priv_dev->dev, "read: copy_to_user failed (bytes not copied: %d)\n", ret);
+    }
+
+    // 缓冲区属于缓冲池，归还即可；归还时会唤醒等待空间的写者和poll()。内联传输归还它在完成FIFO中的名额
+    if (b) {
+        spin_lock(&q->ring_lock);
+        mydma_buf_put_locked(q, b);
+        spin_unlock(&q->ring_lock);
+    } else {
+        atomic_dec(&q->inline_nr);
+        mydma_wake_space(q);
+    }
+
+    if (ret) return -EFAULT; // 如果拷贝失败返回错误，否则返回拷贝的字节数
+    if (res && !mfile->tagged) return res; // 带标签模式下错误码在完成事件头中
+    return hdr_len + bytes_to_copy;
+}
+
+static ssize_t mydma_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos)
+{
+    struct mydma_file *mfile = filp->private_data;
+    ssize_t ret;
+    int idx;
+
+    ret = mydma_fop_enter(mfile->priv_dev, &idx);
+    if (ret) return ret;
+    ret = mydma_do_read(filp, buf, count);
+    mydma_fop_exit(mfile->priv_dev, idx);
+    return ret;
+}
+
+// 写者的背压：cond不成立时在space_wait_queue上睡眠，直到回收路径腾出槽位或缓冲区使cond成立。
+// cond失败时不能有副作用，会被反复求值。返回0表示cond已成立；O_NONBLOCK的文件不等待，直接返回-EAGAIN
+#define mydma_wait_space(q, filp, cond)                                                      \
+({                                                                                           \
+    long __t = 1;                                                                            \
+    bool __dying = false;                                                                    \
+    if (!(cond)) {                                                                           \
+        if ((filp)->f_flags & O_NONBLOCK)                                                    \
+            __t = -EAGAIN;                                                                   \
+        else                                                                                 \
+            __t = wait_event_interruptible_timeout((q)->space_wait_queue,                    \
+                                                   (cond) || (__dying = READ_ONCE((q)->priv_dev->dying)), \
+                                                   mydma_wait_timeout((filp)->private_data, 0)); \
+        if (__dying) {                                                                       \
+            __t = -ENODEV;                                                                   \
+        } else if (__t == 0) {                                                               \
+            mydma_stat_inc((q)->priv_dev, timeouts);                                         \
+            __t = -ETIMEDOUT;                                                                \
+        }                                                                                    \
+    }                                                                                        \
+    __t > 0 ? 0 : (int)__t;                                                                  \
+})
+
+// 内联传输：数据随描述符写入环形缓冲区，设备处理后写回同一个描述符。不占用缓冲池，
+// 设备也不必为取数据再做一次DMA读。完成FIFO中给内联传输留的名额用完时，等待read()取走结果
+static int mydma_write_inline(struct file *filp, const char __user *buf, size_t count, u64 tag)
+{
+    struct mydma_file *mfile = filp->private_data;
+    struct mydma_queue *q = mfile->q;
+    u8 data[MYDMA_INLINE_MAX];
+    struct dma_context *ctx;
+    u32 slot;
+    int ret;
+
+    if (copy_from_user(data, buf, count)) return -EFAULT;
+
+    ret = mydma_wait_space(q, filp, atomic_add_unless(&q->inline_nr, 1, q->nr_bufs));
+    if (ret) return ret;
+    ret = mydma_wait_space(q, filp, mydma_slots_reserve(q, 1, 1, &slot) != 0);
+    if (ret) {
+        atomic_dec(&q->inline_nr);
+        mydma_wake_space(q);
+        return ret;
+    }
+
+    ctx = &q->dma_ctx_ring[slot];
+    ctx->buf = NULL;
+    ctx->file = mfile;
+    ctx->size = count;
+    ctx->user_data = tag;
+    mydma_write_desc_inline(q, slot, data, count);
+    trace_mydma_submit(q->qid, slot, 0, 0, count, MYDMA_DESC_F_INLINE | MYDMA_DESC_F_LAST);
+    mydma_stat_inc(q->priv_dev, submitted);
+
+    // 先写完描述符和上下文，再让门铃看到READY
+    smp_store_release(&ctx->state, MYDMA_SLOT_READY);
+    mydma_ring_doorbell(q);
+    return 0;
+}
+
+static ssize_t mydma_do_write(struct file *filp, const char __user *buf, size_t count)
+{
+    struct mydma_file *mfile = filp->private_data;
+    struct mydma_dev *priv_dev = mfile->priv_dev;
+    struct mydma_queue *q = mfile->q;
+    struct mydma_tag_hdr hdr = { 0 };
+    size_t hdr_len = 0;
+    struct mydma_buf *b;
+    u32 crc = 0;
+    int ret;
+
+    // 带标签模式：数据前的标签头只记录下来，不参与DMA；直接模式是同步的，不需要标签。
+    // 校验完整性时数据必须经过缓冲池的拷贝，不走直接模式和内联描述符
+    if (mfile->tagged) {
+        hdr_len = sizeof(hdr);
+        if (count <= hdr_len) return -EINVAL;
+        if (copy_from_user(&hdr, buf, hdr_len)) return -EFAULT;
+        buf += hdr_len;
+        count -= hdr_len;
+    } else if (mfile->direct_min && count >= mfile->direct_min && !mfile->crc) {
+        return mydma_write_direct(mfile, buf, count);
+    }
+
+    if (count > priv_dev->max_transfer) {
+        dev_warn(priv_dev->dev, "Write size %zu exceeds max %u\n", count, priv_dev->max_transfer);
+        return -EINVAL;
+    }
+
+    // 小消息随描述符一起写入环形缓冲区，不经过缓冲池
+    if (count <= priv_dev->inline_max && !mfile->crc) {
+        ret = mydma_write_inline(filp, buf, count, hdr.tag);
+        return ret ? ret : hdr_len + count;
+    }
+
+    // “就地”DMA操作从缓冲池中取足够多的相邻缓冲区，整体在DMA地址上连续；缓冲池用完时等待read()归还
+    ret = mydma_wait_space(q, filp, (b = mydma_buf_get(q, NULL, DIV_ROUND_UP(count, MYDMA_POOL_BUF_SIZE))) != NULL);
+    if (ret) return ret;
+
+    // 从用户空间拷贝数据到DMA缓冲区 (不能持锁，可能睡眠)
+    ret = mfile->crc ? mydma_copy_in_crc(b->virt_addr, buf, count, &crc) : copy_from_user(b->virt_addr, buf, count);
+    if (ret) {
+        dev_err(priv_dev->dev, "write: copy_from_user failed\n");
+        ret = -EFAULT;
+        goto err_put_buf;
+    }
+    if (mfile->crc) {
+        // 设备的CRC字段按描述符计算，拆成多个描述符的传输由read()校验
+        b->crc = crc;
+        b->crc_check = priv_dev->crc_hw && count <= MYDMA_DESC_MAX_LEN ? MYDMA_CRC_HW : MYDMA_CRC_SW;
+    }
+
+    // 缓冲区只属于本次write()，无锁地保留槽位并提交，多个写者可以并发进行；环形缓冲区满时等待回收
+    b->file = mfile;
+    b->user_data = hdr.tag;
+    ret = mydma_wait_space(q, filp, mydma_submit(q, b, count) == 0);
+    if (ret) goto err_put_buf;
+
+    return hdr_len + count;
+
+err_put_buf:
+    spin_lock(&q->ring_lock);
+    mydma_buf_put_locked(q, b);
+    spin_unlock(&q->ring_lock);
+    return ret;
+}
+
+// 提交期间队列持有设备的运行时电源管理引用
+static ssize_t mydma_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos)
+{
+    struct mydma_file *mfile = filp->private_data;
+    struct mydma_queue *q = mfile->q;
+    ssize_t ret;
+    int idx;
+
+    if (count == 0) return 0;
+    ret = mydma_fop_enter(mfile->priv_dev, &idx);
+    if (ret) return ret;
+    WRITE_ONCE(mfile->q_used, true);
+    ret = mydma_pm_get(q);
+    if (!ret) {
+        ret = mydma_do_write(filp, buf, count);
+        mydma_pm_put(q);
+    }
+    mydma_fop_exit(mfile->priv_dev, idx);
+    return ret;
+}
+
+// writev(): 每个iovec段对应一个描述符(超过缓冲区大小的段再切分)，每批只写一次尾指针，返回入队的字节数
+static ssize_t mydma_do_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+    struct mydma_file *mfile = iocb->ki_filp->private_data;
+    struct mydma_queue *q = mfile->q;
+    struct file *filp = iocb->ki_filp;
+    struct mydma_buf *bufs[MYDMA_WRITEV_BATCH];
+    struct mydma_buf *b;
+    struct mydma_tag_hdr hdr = { 0 };
+    size_t hdr_len = mfile->tagged ? sizeof(hdr) : 0;
+    size_t queued = 0;
+    size_t len;
+    u32 nr, reserved, slot, i, j;
+    int ret = 0;
+
+    while (iov_iter_count(from) && !ret) {
+        // 第一阶段：不持锁地取缓冲区并从用户空间拷贝数据 (可能睡眠)
+        for (nr = 0; nr < MYDMA_WRITEV_BATCH && iov_iter_count(from); ) {
+            len = iov_iter_single_seg_count(from);
+            if (!len) { iov_iter_advance(from, 0); continue; } // 跳过空段
+            // 带标签模式下每个段都以标签头开头，且不再切分
+            if (hdr_len && (len <= hdr_len || len > hdr_len + MYDMA_POOL_BUF_SIZE)) { ret = -EINVAL; break; }
+            len = min_t(size_t, len - hdr_len, MYDMA_POOL_BUF_SIZE);
+
+            // 缓冲池用完时先提交手中的这批；一个都没有时才等待read()归还
+            b = mydma_buf_get(q, NULL, 1);
+            if (!b && nr) break;
+            if (!b) {
+                ret = mydma_wait_space(q, filp, (b = mydma_buf_get(q, NULL, 1)) != NULL);
+                if (ret) break;
+            }
+
+            if (copy_from_iter(&hdr, hdr_len, from) != hdr_len ||
+                copy_from_iter(b->virt_addr, len, from) != len) {
+                spin_lock(&q->ring_lock);
+                mydma_buf_put_locked(q, b);
+                spin_unlock(&q->ring_lock);
+                ret = -EFAULT;
+                break;
+            }
+            b->len = len;
+            b->file = mfile;
+            b->user_data = hdr.tag;
+            if (mfile->crc) {
+                // 段不超过一个缓冲区，刚拷贝完还在缓存中
+                b->crc = crc32c(~0U, b->virt_addr, len);
+                b->crc_check = mfile->priv_dev->crc_hw ? MYDMA_CRC_HW : MYDMA_CRC_SW;
+            }
+            bufs[nr++] = b;
+        }
+
+        // 第二阶段：尽量一次保留整批槽位并无锁地填充描述符，每次保留只敲一次门铃；
+        // 环形缓冲区满时等待回收，等不到(O_NONBLOCK、超时或信号)时归还剩下的缓冲区
+        for (i = 0; i < nr; i += reserved) {
+            ret = mydma_wait_space(q, filp, (reserved = mydma_slots_reserve(q, 1, nr - i, &slot)) != 0);
+            if (ret) break;
+            for (j = i; j < i + reserved; j++) {
+                slot = mydma_queue_desc(q, slot, bufs[j], bufs[j]->len);
+                queued += hdr_len + bufs[j]->len;
+            }
+            mydma_ring_doorbell(q);
+        }
+        if (i < nr) {
+            spin_lock(&q->ring_lock);
+            for (; i < nr; i++)
+                mydma_buf_put_locked(q, bufs[i]);
+            spin_unlock(&q->ring_lock);
+        }
+    }
+
+    return queued ? queued : ret;
+}
+
+static ssize_t mydma_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+    struct mydma_file *mfile = iocb->ki_filp->private_data;
+    struct mydma_queue *q = mfile->q;
+    ssize_t ret;
+    int idx;
+
+    ret = mydma_fop_enter(mfile->priv_dev, &idx);
+    if (ret) return ret;
+    WRITE_ONCE(mfile->q_used, true);
+    ret = mydma_pm_get(q);
+    if (!ret) {
+        ret = mydma_do_write_iter(iocb, from);
+        mydma_pm_put(q);
+    }
+    mydma_fop_exit(mfile->priv_dev, idx);
+    return ret;
+}
+
+// 批量提交零拷贝缓冲区：填好全部描述符后只写一次尾指针，返回入队的个数
+static long mydma_submit_batch(struct mydma_file *mfile, void __user *argp)
+{
+    struct mydma_dev *priv_dev = mfile->priv_dev;
+    struct mydma_queue *q = mfile->q;
+    struct mydma_buf_batch batch;
+    struct mydma_buf_req *reqs;
+    struct mydma_buf *b;
+    u32 slot, i;
+    long ret = 0;
+
+    if (copy_from_user(&batch, argp, sizeof(batch))) return -EFAULT;
+    if (batch.nr == 0) return 0;
+    // 一次最多只能入队ring_size - 1个描述符，多余的部分由用户下次再提交
+    batch.nr = min(batch.nr, priv_dev->ring_size - 1);
+
+    reqs = memdup_user(u64_to_user_ptr(batch.reqs), batch.nr * sizeof(*reqs));
+    if (IS_ERR(reqs)) return PTR_ERR(reqs);
+
+    spin_lock(&q->ring_lock);
+    for (i = 0; i < batch.nr; i++) {
+        // 遇到第一个非法项即停止，之前的项照常提交
+        b = mydma_file_buf_locked(mfile, reqs[i].buf);
+        if (!b || b->state == MYDMA_BUF_INFLIGHT || reqs[i].len == 0 || reqs[i].len > MYDMA_POOL_BUF_SIZE) {
+            ret = -EINVAL;
+            break;
+        }
+        // 逐项保留槽位，保证保留到的槽位都能填上
+        if (!mydma_slots_reserve_locked(q, 1, 1, &slot)) break;
+        mydma_queue_desc(q, slot, b, reqs[i].len);
+    }
+    if (i) mydma_ring_doorbell(q);
+    else if (!ret) ret = -EBUSY; // 环形缓冲区已满
+    spin_unlock(&q->ring_lock);
+
+    kfree(reqs);
+    return i ? i : ret;
+}
+
+// --- dma-buf 导出/导入 ---
+
+// 从整个缓冲池的sg表pool中取出[off, off + len)一段，组成新的sg表
+static int mydma_sgt_slice(struct sg_table *sgt, struct sg_table *pool, size_t off, size_t len)
+{
+    struct scatterlist *sg, *d;
+    unsigned int i, nents = 0;
+    size_t pos = 0, start, n;
+    int ret;
+
+    for_each_sgtable_sg(pool, sg, i) {
+        if (pos + sg->length > off && pos < off + len) nents++;
+        pos += sg->length;
+    }
+    ret = sg_alloc_table(sgt, nents, GFP_KERNEL);
+    if (ret) return ret;
+
+    d = sgt->sgl;
+    pos = 0;
+    for_each_sgtable_sg(pool, sg, i) {
+        if (pos + sg->length > off && pos < off + len) {
+            start = sg->offset + max(off, pos) - pos;
+            n = min(off + len, pos + sg->length) - max(off, pos);
+            sg_set_page(d, nth_page(sg_page(sg), start >> PAGE_SHIFT), n, offset_in_page(start));
+            d = sg_next(d);
+        }
+        pos += sg->length;
+    }
+    return 0;
+}
+
+// 为导入方设备映射导出的缓冲区：缓冲池是一致性内存，dma_get_sgtable()只接受整块分配，
+// 先取出整个缓冲池的页面，截出该缓冲区的一段组成sg表，再按导入方设备做DMA映射
+static struct sg_table *mydma_dmabuf_map(struct dma_buf_attachment *attach, enum dma_data_direction dir)
+{
+    struct mydma_dmabuf_export *ex = attach->dmabuf->priv;
+    struct mydma_dev *priv_dev = ex->q->priv_dev;
+    struct sg_table pool, *sgt;
+    int ret;
+
+    if (READ_ONCE(priv_dev->dying)) return ERR_PTR(-ENODEV);
+    sgt = kzalloc(sizeof(*sgt), GFP_KERNEL);
+    if (!sgt) return ERR_PTR(-ENOMEM);
+
+    ret = dma_get_sgtable(priv_dev->dev, &pool, priv_dev->pool_virt_addr, priv_dev->pool_dma_addr,
+                          priv_dev->pool_size);
+    if (ret) goto err_free;
+    ret = mydma_sgt_slice(sgt, &pool, ex->b->virt_addr - priv_dev->pool_virt_addr, attach->dmabuf->size);
+    sg_free_table(&pool);
+    if (ret) goto err_free;
+
+    ret = dma_map_sgtable(attach->dev, sgt, dir, 0);
+    if (ret) {
+        sg_free_table(sgt);
+        goto err_free;
+    }
+    return sgt;
+
+err_free:
+    kfree(sgt);
+    return ERR_PTR(ret);
+}
+
+static void mydma_dmabuf_unmap(struct dma_buf_attachment *attach, struct sg_table *sgt,
+                               enum dma_data_direction dir)
+{
+    dma_unmap_sgtable(attach->dev, sgt, dir, 0);
+    sg_free_table(sgt);
+    kfree(sgt);
+}
+
+static int mydma_dmabuf_mmap(struct dma_buf *dmabuf, struct vm_area_struct *vma)
+{
+    struct mydma_dmabuf_export *ex = dmabuf->priv;
+    struct mydma_dev *priv_dev = ex->q->priv_dev;
+
+    if (READ_ONCE(priv_dev->dying)) return -ENODEV;
+    // dma_mmap_coherent()同样只接受整块分配：vm_pgoff是dma-buf内的偏移(dma-buf核心已检查不超出dmabuf->size)，
+    // 加上该缓冲区在池内的页偏移
+    vma->vm_pgoff += (ex->b->virt_addr - priv_dev->pool_virt_addr) >> PAGE_SHIFT;
+    return dma_mmap_coherent(priv_dev->dev, vma, priv_dev->pool_virt_addr, priv_dev->pool_dma_addr,
+                             priv_dev->pool_size);
+}
+
+// 最后一个dma-buf引用释放；缓冲区的持有者已关闭文件时，由这里归还缓冲池。
+// 设备已解绑时缓冲池一直保留到这里放下设备的引用
+static void mydma_dmabuf_release(struct dma_buf *dmabuf)
+{
+    struct mydma_dmabuf_export *ex = dmabuf->priv;
+    struct mydma_queue *q = ex->q;
+    struct mydma_buf *b = ex->b;
+
+    spin_lock(&q->ring_lock);
+    if (--b->exports == 0 && b->orphan && b->state != MYDMA_BUF_INFLIGHT)
+        mydma_buf_put_locked(q, b);
+    spin_unlock(&q->ring_lock);
+    mydma_dev_put(q->priv_dev);
+    kfree(ex);
+}
+
+static const struct dma_buf_ops mydma_dmabuf_ops = {
+    .map_dma_buf   = mydma_dmabuf_map,
+    .unmap_dma_buf = mydma_dmabuf_unmap,
+    .mmap          = mydma_dmabuf_mmap,
+    .release       = mydma_dmabuf_release,
+};
+
+// MYDMA_IOC_BUF_EXPORT：把零拷贝缓冲区导出为dma-buf，GPU/NIC等其他设备的驱动导入后可以直接对它做DMA。
+// 返回新的文件描述符；导出期间缓冲区不能BUF_FREE
+static long mydma_buf_export(struct mydma_file *mfile, void __user *argp)
+{
+    DEFINE_DMA_BUF_EXPORT_INFO(exp_info);
+    struct mydma_queue *q = mfile->q;
+    struct mydma_dmabuf_export *ex;
+    struct mydma_buf_export req;
+    struct dma_buf *dmabuf;
+    struct mydma_buf *b;
+    int fd;
+
+    if (copy_from_user(&req, argp, sizeof(req))) return -EFAULT;
+    if (req.flags & ~O_CLOEXEC) return -EINVAL;
+
+    ex = kzalloc(sizeof(*ex), GFP_KERNEL);
+    if (!ex) return -ENOMEM;
+
+    spin_lock(&q->ring_lock);
+    b = mydma_file_buf_locked(mfile, req.buf);
+    if (b) b->exports++;
+    spin_unlock(&q->ring_lock);
+    if (!b) { kfree(ex); return -EINVAL; }
+    ex->q = q;
+    ex->b = b;
+
+    exp_info.ops = &mydma_dmabuf_ops;
+    exp_info.size = (size_t)b->nr_bufs * MYDMA_POOL_BUF_SIZE;
+    exp_info.flags = O_RDWR;
+    exp_info.priv = ex;
+    dmabuf = dma_buf_export(&exp_info);
+    if (IS_ERR(dmabuf)) {
+        // 调用者仍持有该缓冲区，只需撤销计数
+        spin_lock(&q->ring_lock);
+        b->exports--;
+        spin_unlock(&q->ring_lock);
+        kfree(ex);
+        return PTR_ERR(dmabuf);
+    }
+
+    // 从这里起ex、导出计数和设备的引用都由mydma_dmabuf_release()负责
+    kref_get(&mfile->priv_dev->ref);
+    fd = dma_buf_fd(dmabuf, req.flags);
+    if (fd < 0) dma_buf_put(dmabuf);
+    return fd;
+}
+
+// 导入方是动态的，但导入的dma-buf在传输期间一直pin住，导出方不会迁移它，无需处理move_notify
+static void mydma_dmabuf_move_notify(struct dma_buf_attachment *attach)
+{
+}
+
+// allow_peer2peer：导出方可以给出对端PCIe设备的BAR地址，数据经交换机直接在设备之间传输(P2PDMA)
+static const struct dma_buf_attach_ops mydma_importer_ops = {
+    .allow_peer2peer = true,
+    .move_notify     = mydma_dmabuf_move_notify,
+};
+
+// 导入一个外部dma-buf并为本设备映射。失败时m中已完成的部分由mydma_dmabuf_unimport()撤销
+static int mydma_dmabuf_import(struct mydma_dev *priv_dev, int fd, struct mydma_dmabuf_map *m)
+{
+    struct dma_buf *dmabuf;
+    int ret;
+
+    dmabuf = dma_buf_get(fd);
+    if (IS_ERR(dmabuf)) return PTR_ERR(dmabuf);
+    m->dmabuf = dmabuf;
+
+    m->attach = dma_buf_dynamic_attach(dmabuf, priv_dev->dev, &mydma_importer_ops, NULL);
+    if (IS_ERR(m->attach)) {
+        ret = PTR_ERR(m->attach);
+        m->attach = NULL;
+        return ret;
+    }
+
+    dma_resv_lock(dmabuf->resv, NULL);
+    ret = dma_buf_pin(m->attach);
+    if (!ret) {
+        m->sgt = dma_buf_map_attachment(m->attach, DMA_BIDIRECTIONAL);
+        if (IS_ERR(m->sgt)) {
+            ret = PTR_ERR(m->sgt);
+            m->sgt = NULL;
+            dma_buf_unpin(m->attach);
+        }
+    }
+    dma_resv_unlock(dmabuf->resv);
+    return ret;
+}
+
+// 把游标定位到dma-buf中偏移off处
+static int mydma_cursor_init_dmabuf(struct mydma_xfer_cursor *c, struct sg_table *sgt, u64 off)
+{
+    struct scatterlist *sg;
+    int i;
+
+    for_each_sgtable_dma_sg(sgt, sg, i) {
+        if (off < sg_dma_len(sg)) {
+            c->sg = sg;
+            c->addr = sg_dma_address(sg) + off;
+            c->left = sg_dma_len(sg) - off;
+            return 0;
+        }
+        off -= sg_dma_len(sg);
+    }
+    return -EINVAL;
+}
+
+// 游标前进n字节(不超过当前连续段)，当前段用完时进入下一个DMA段
+static void mydma_cursor_advance(struct mydma_xfer_cursor *c, u32 n)
+{
+    c->addr += n;
+    c->left -= n;
+    if (c->left || !c->sg) return;
+    c->sg = sg_next(c->sg);
+    if (c->sg) {
+        c->addr = sg_dma_address(c->sg);
+        c->left = sg_dma_len(c->sg);
+    }
+}
+
+// 沿两端的游标把len字节拆成两端都连续的块，每块再按MYDMA_DESC_MAX_LEN拆成描述符。
+// slot为NULL时只计算所需的描述符个数，否则从*slot开始填充；返回描述符个数，某一端提前用完时返回-EINVAL
+static int mydma_xfer_walk(struct mydma_queue *q, struct mydma_buf *b, struct mydma_xfer_cursor in,
+                           struct mydma_xfer_cursor out, u32 len, u32 *slot)
+{
+    u32 chunk;
+    int nr = 0;
+
+    while (len) {
+        chunk = min3(len, in.left, out.left);
+        if (!chunk) return -EINVAL;
+        if (slot) *slot = mydma_fill_descs(q, *slot, b, in.addr, out.addr, chunk, chunk == len);
+        nr += mydma_desc_count(chunk);
+        mydma_cursor_advance(&in, chunk);
+        mydma_cursor_advance(&out, chunk);
+        len -= chunk;
+    }
+    return nr;
+}
+
+// MYDMA_IOC_DMABUF_XFER：一端或两端是外部dma-buf的传输，数据在设备之间直接流动，不经过CPU拷贝。
+// 导入的映射在硬件释放之前不能撤销，因此与直接模式一样同步等待完成，放弃等待时交给mydma_direct_gc()
+static long mydma_dmabuf_xfer(struct file *filp, void __user *argp)
+{
+    struct mydma_file *mfile = filp->private_data;
+    struct mydma_dev *priv_dev = mfile->priv_dev;
+    struct device *dev = priv_dev->dev;
+    struct mydma_queue *q = mfile->q;
+    struct mydma_buf *pb[2] = { NULL, NULL };
+    struct mydma_xfer_cursor cur[2];
+    struct mydma_dmabuf_xfer x;
+    struct mydma_direct *d;
+    s32 fd[2];
+    u64 off[2];
+    u32 idx[2], slot;
+    long timeout;
+    int nr, i, ret = 0;
+    bool done;
+
+    if (copy_from_user(&x, argp, sizeof(x))) return -EFAULT;
+    // 两端都是缓冲区时应使用MYDMA_IOC_SUBMIT_OOP
+    if (x.len == 0 || x.resv || (x.in_fd < 0 && x.out_fd < 0)) return -EINVAL;
+    fd[0] = x.in_fd;
+    fd[1] = x.out_fd;
+    off[0] = x.in_off;
+    off[1] = x.out_off;
+    idx[0] = x.in_buf;
+    idx[1] = x.out_buf;
+
+    mydma_direct_gc(q, false);
+    d = kzalloc(sizeof(*d), GFP_KERNEL);
+    if (!d) return -ENOMEM;
+
+    for (i = 0; i < 2; i++) {
+        if (fd[i] >= 0) {
+            ret = mydma_dmabuf_import(priv_dev, fd[i], &d->imp[i]);
+            if (!ret && (off[i] > d->imp[i].dmabuf->size || x.len > d->imp[i].dmabuf->size - off[i]))
+                ret = -EINVAL;
+            if (!ret) ret = mydma_cursor_init_dmabuf(&cur[i], d->imp[i].sgt, off[i]);
+        } else {
+            // 缓冲区一端在传输期间处于INFLIGHT，完成时由回收路径释放
+            spin_lock(&q->ring_lock);
+            pb[i] = mydma_file_buf_locked(mfile, idx[i]);
+            if (!pb[i] || x.len > pb[i]->nr_bufs * MYDMA_POOL_BUF_SIZE) ret = -EINVAL;
+            else if (pb[i]->state == MYDMA_BUF_INFLIGHT) ret = -EBUSY;
+            else pb[i]->state = MYDMA_BUF_INFLIGHT;
+            if (ret) pb[i] = NULL;
+            spin_unlock(&q->ring_lock);
+            if (!ret) {
+                cur[i].sg = NULL;
+                cur[i].addr = pb[i]->dma_addr;
+                cur[i].left = x.len;
+            }
+        }
+        if (ret) goto err_free;
+    }
+
+    // 整次传输一次性放进环形缓冲区
+    nr = mydma_xfer_walk(q, &d->b, cur[0], cur[1], x.len, NULL);
+    if (nr < 0 || nr > priv_dev->ring_size - 1) {
+        dev_warn(dev, "dma-buf transfer of %u bytes needs too many descriptors\n", x.len);
+        ret = -EINVAL;
+        goto err_free;
+    }
+
+    d->b.direct = true;
+    d->b.file = mfile;
+    d->b.len = x.len;
+    d->b.pending = nr;
+    d->b.state = MYDMA_BUF_INFLIGHT;
+    ret = mydma_wait_space(q, filp, mydma_slots_reserve(q, nr, nr, &slot) != 0);
+    if (ret) goto err_free;
+
+    d->b.src = pb[0];
+    d->b.dst = pb[1];
+    mydma_stat_inc(priv_dev, submitted);
+    mydma_xfer_walk(q, &d->b, cur[0], cur[1], x.len, &slot);
+    mydma_ring_doorbell(q);
+
+    timeout = wait_event_killable_timeout(mfile->wait,
+                                          mydma_buf_done(q, &d->b),
+                                          mydma_wait_timeout(mfile, x.len));
+
+    spin_lock(&q->ring_lock);
+    done = d->b.state == MYDMA_BUF_DONE;
+    if (!done) {
+        d->b.file = NULL; // 不再有人等待它的完成事件
+        list_add_tail(&d->orphan_node, &q->direct_orphans);
+    }
+    spin_unlock(&q->ring_lock);
+
+    if (!done) {
+        // 设备可能仍在访问导入的内存，留待完成后再释放；没有超时也没有被杀死说明设备正在解绑
+        if (timeout > 0) return -ENODEV;
+        if (timeout == 0) mydma_stat_inc(priv_dev, timeouts);
+        dev_err(dev, "dma-buf transfer %s!\n", timeout == 0 ? "timeout" : "killed");
+        return timeout == 0 ? -ETIMEDOUT : timeout;
+    }
+
+    ret = d->b.res;
+    mydma_direct_free(priv_dev, d);
+    return ret;
+
+err_free:
+    spin_lock(&q->ring_lock);
+    for (i = 0; i < 2; i++)
+        if (pb[i]) pb[i]->state = MYDMA_BUF_OWNED;
+    spin_unlock(&q->ring_lock);
+    mydma_direct_free(priv_dev, d);
+    return ret;
+}
+
+static long mydma_do_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    struct mydma_file *mfile = filp->private_data;
+    struct mydma_dev *priv_dev = mfile->priv_dev;
+    struct mydma_queue *q = mfile->q;
+    void __user *argp = (void __user *)arg;
+    struct mydma_pool_info info;
+    struct mydma_buf_req req;
+    struct mydma_oop_req oop;
+    struct mydma_buf *b, *src;
+    long timeout;
+    u32 idx;
+    int ret = 0;
+
+    switch (cmd) {
+    case MYDMA_IOC_POOL_INFO:
+        info.nr_bufs = priv_dev->pool_nr_bufs;
+        info.buf_size = MYDMA_POOL_BUF_SIZE;
+        return copy_to_user(argp, &info, sizeof(info)) ? -EFAULT : 0;
+
+    case MYDMA_IOC_BUF_ALLOC:
+        WRITE_ONCE(mfile->q_used, true);
+        spin_lock(&q->ring_lock);
+        b = mydma_buf_get_locked(q, mfile, 1);
+        spin_unlock(&q->ring_lock);
+        if (!b) return -EBUSY;
+        idx = b - priv_dev->pool_bufs;
+        if (put_user(idx, (u32 __user *)argp)) {
+            spin_lock(&q->ring_lock);
+            mydma_buf_put_locked(q, b);
+            spin_unlock(&q->ring_lock);
+            return -EFAULT;
+        }
+        return 0;
+
+    case MYDMA_IOC_BUF_FREE:
+        if (get_user(idx, (u32 __user *)argp)) return -EFAULT;
+        mutex_lock(&mfile->map_lock);
+        spin_lock(&q->ring_lock);
+        b = mydma_file_buf_locked(mfile, idx);
+        if (!b) ret = -EINVAL;
+        else if (b->state == MYDMA_BUF_INFLIGHT || b->exports) ret = -EBUSY;
+        else mydma_buf_put_locked(q, b);
+        spin_unlock(&q->ring_lock);
+        // 缓冲区之后可能交给别的文件，撤销本文件对它的映射
+        if (!ret) unmap_mapping_range(filp->f_mapping, (loff_t)idx * MYDMA_POOL_BUF_SIZE, MYDMA_POOL_BUF_SIZE, 1);
+        mutex_unlock(&mfile->map_lock);
+        return ret;
+
+    case MYDMA_IOC_SUBMIT:
+        // 用户已在映射的缓冲区中写好len字节，直接提交，无需copy_from_user
+        if (copy_from_user(&req, argp, sizeof(req))) return -EFAULT;
+        if (req.len == 0 || req.len > MYDMA_POOL_BUF_SIZE) return -EINVAL;
+        spin_lock(&q->ring_lock);
+        b = mydma_file_buf_locked(mfile, req.buf);
+        if (!b) ret = -EINVAL;
+        else if (b->state == MYDMA_BUF_INFLIGHT) ret = -EBUSY;
+        else ret = mydma_submit_locked(q, b, req.len);
+        spin_unlock(&q->ring_lock);
+        return ret;
+
+    case MYDMA_IOC_COMPLETE:
+        // 等待缓冲区完成，结果留在映射的缓冲区中，无需copy_to_user
+        if (copy_from_user(&req, argp, sizeof(req))) return -EFAULT;
+        spin_lock(&q->ring_lock);
+        b = mydma_file_buf_locked(mfile, req.buf);
+        if (!b || b->state == MYDMA_BUF_OWNED) ret = -EINVAL;
+        spin_unlock(&q->ring_lock);
+        if (ret) return ret;
+
+        if (mfile->poll_usecs)
+            mydma_busy_poll(q, mfile->poll_usecs, READ_ONCE(b->state) == MYDMA_BUF_DONE);
+        timeout = wait_event_interruptible_timeout(mfile->wait,
+                                                   mydma_buf_done(q, b),
+                                                   mydma_wait_timeout(mfile, b->len));
+        if (timeout == 0) { mydma_stat_inc(priv_dev, timeouts); return -ETIMEDOUT; }
+        if (timeout < 0) return timeout;
+
+        spin_lock(&q->ring_lock);
+        if (b->owner == mfile && b->state == MYDMA_BUF_DONE) {
+            b->state = MYDMA_BUF_OWNED;
+            req.len = b->len;
+            ret = b->res;
+            b->res = 0;
+        } else {
+            ret = READ_ONCE(priv_dev->dying) ? -ENODEV : -EINVAL;
+        }
+        spin_unlock(&q->ring_lock);
+        if (ret) return ret;
+        return copy_to_user(argp, &req, sizeof(req)) ? -EFAULT : 0;
+
+    case MYDMA_IOC_SUBMIT_BATCH:
+        return mydma_submit_batch(mfile, argp);
+
+    case MYDMA_IOC_SUBMIT_OOP:
+        // 输入和输出分别位于两个缓冲区，结果直接写入输出缓冲区
+        if (copy_from_user(&oop, argp, sizeof(oop))) return -EFAULT;
+        if (oop.len == 0 || oop.len > MYDMA_POOL_BUF_SIZE || oop.in_buf == oop.out_buf) return -EINVAL;
+        spin_lock(&q->ring_lock);
+        b = mydma_file_buf_locked(mfile, oop.out_buf);
+        src = mydma_file_buf_locked(mfile, oop.in_buf);
+        if (!b || !src) ret = -EINVAL;
+        else if (b->state == MYDMA_BUF_INFLIGHT || src->state == MYDMA_BUF_INFLIGHT) ret = -EBUSY;
+        else ret = mydma_submit_oop_locked(q, src, b, oop.len);
+        spin_unlock(&q->ring_lock);
+        return ret;
+
+    case MYDMA_IOC_BUF_EXPORT:
+        return mydma_buf_export(mfile, argp);
+
+    case MYDMA_IOC_DMABUF_XFER:
+        return mydma_dmabuf_xfer(filp, argp);
+
+    case MYDMA_IOC_SET_OPT:
+    case MYDMA_IOC_GET_OPT:
+        return mydma_file_opt(mfile, cmd, argp);
+
+    case MYDMA_IOC_URING_SETUP:
+        WRITE_ONCE(mfile->q_used, true);
+        return mydma_uring_setup(mfile, argp);
+
+    case MYDMA_IOC_URING_ENTER:
+        return mydma_uring_enter(mfile, argp);
+
+    default:
+        return -ENOTTY;
+    }
+}
+
+// 提交类的命令要访问设备寄存器，执行期间队列持有设备的运行时电源管理引用
+static long mydma_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    struct mydma_file *mfile = filp->private_data;
+    struct mydma_queue *q = mfile->q;
+    long ret;
+    int idx;
+
+    ret = mydma_fop_enter(mfile->priv_dev, &idx);
+    if (ret) return ret;
+
+    switch (cmd) {
+    case MYDMA_IOC_SUBMIT:
+    case MYDMA_IOC_SUBMIT_BATCH:
+    case MYDMA_IOC_SUBMIT_OOP:
+    case MYDMA_IOC_DMABUF_XFER:
+    case MYDMA_IOC_URING_ENTER:
+        ret = mydma_pm_get(q);
+        if (ret) break;
+        ret = mydma_do_ioctl(filp, cmd, arg);
+        mydma_pm_put(q);
+        break;
+    default:
+        ret = mydma_do_ioctl(filp, cmd, arg);
+        break;
+    }
+
+    mydma_fop_exit(mfile->priv_dev, idx);
+    return ret;
+}
+
+// 映射本文件BUF_ALLOC得到的缓冲区：偏移N * buf_size起的每个缓冲区都必须属于本文件，
+// 别的文件的缓冲区和write()/read()正在使用的缓冲区不能映射。调用者持有map_lock
+static int mydma_mmap_bufs(struct mydma_file *mfile, struct vm_area_struct *vma)
+{
+    struct mydma_dev *priv_dev = mfile->priv_dev;
+    struct mydma_queue *q = mfile->q;
+    unsigned long first = vma->vm_pgoff, nr = vma_pages(vma), i;
+    int ret = 0;
+
+    BUILD_BUG_ON(MYDMA_POOL_BUF_SIZE != PAGE_SIZE);
+    if (first >= priv_dev->pool_nr_bufs || nr > priv_dev->pool_nr_bufs - first) return -EINVAL;
+
+    // 本文件只能持有自己队列分片中的缓冲区，归属在该队列的ring_lock下修改
+    spin_lock(&q->ring_lock);
+    for (i = first; i < first + nr; i++) {
+        if (priv_dev->pool_bufs[i].owner != mfile) { ret = -EACCES; break; }
+    }
+    spin_unlock(&q->ring_lock);
+    if (ret) return ret;
+
+    // dma_mmap_coherent()只接受整块分配，以vm_pgoff作为池内偏移
+    return dma_mmap_coherent(priv_dev->dev, vma, priv_dev->pool_virt_addr,
+                             priv_dev->pool_dma_addr, priv_dev->pool_size);
+}
+
+// 将本文件的缓冲区(偏移N * buf_size)或共享提交/完成队列(偏移MYDMA_MMAP_OFF_URING)映射到用户空间
+static int mydma_do_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    struct mydma_file *mfile = filp->private_data;
+    struct mydma_queue *q = mfile->q;
+    struct mydma_uring *ur;
+    int ret;
+
+    // 共享提交/完成队列区域
+    if (vma->vm_pgoff == (MYDMA_MMAP_OFF_URING >> PAGE_SHIFT)) {
+        spin_lock(&q->ring_lock);
+        ur = mfile->uring;
+        spin_unlock(&q->ring_lock);
+        if (!ur) return -EINVAL;
+        return remap_vmalloc_range(vma, ur->region, 0);
+    }
+
+    mutex_lock(&mfile->map_lock);
+    ret = mydma_mmap_bufs(mfile, vma);
+    mutex_unlock(&mfile->map_lock);
+    return ret;
+}
+
+// 解绑时撤销缓冲池的映射(mydma_dev_teardown())，之后不会再建立新的映射
+static int mydma_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    struct mydma_file *mfile = filp->private_data;
+    int ret, idx;
+
+    ret = mydma_fop_enter(mfile->priv_dev, &idx);
+    if (ret) return ret;
+    ret = mydma_do_mmap(filp, vma);
+    mydma_fop_exit(mfile->priv_dev, idx);
+    return ret;
+}
+
+// poll()/epoll：有已完成的write()或CQ中有未消费的CQE时可读；环形缓冲区和缓冲池分片都有空闲时可写
+static __poll_t mydma_poll(struct file *filp, poll_table *wait)
+{
+    struct mydma_file *mfile = filp->private_data;
+    struct mydma_queue *q = mfile->q;
+    struct mydma_uring *ur;
+    __poll_t mask = 0;
+    u32 space;
+    int idx;
+
+    if (mydma_fop_enter(mfile->priv_dev, &idx)) return EPOLLERR | EPOLLHUP;
+    poll_wait(filp, &mfile->wait, wait);
+    poll_wait(filp, &q->space_wait_queue, wait);
+
+    spin_lock(&q->ring_lock);
+    mydma_reap_locked(q);
+    ur = mfile->uring;
+    if (mfile->done_count || (ur && ur->cq_tail_k != READ_ONCE(*ur->cq_head)))
+        mask |= EPOLLIN | EPOLLRDNORM;
+    space = (q->queue_head + q->ring_size - atomic_read(&q->res_tail) - 1) & q->ring_mask;
+    if (space && find_first_zero_bit(q->pool_bitmap, q->nr_bufs) < q->nr_bufs)
+        mask |= EPOLLOUT | EPOLLWRNORM;
+    spin_unlock(&q->ring_lock);
+
+    mydma_fop_exit(mfile->priv_dev, idx);
+    return mask;
+}
+
+// 对所有CPU上的某个计数器求和；各CPU的副本不加锁读取，结果只是近似的快照
+static u64 mydma_stat_sum(struct mydma_dev *priv_dev, size_t off)
+{
+    u64 sum = 0;
+    int cpu;
+
+    for_each_possible_cpu(cpu)
+        sum += *(u64 *)((char *)per_cpu_ptr(priv_dev->stats, cpu) + off);
+    return sum;
+}
+
+#define MYDMA_STAT_ATTR(field)                                                              \
+static ssize_t field##_show(struct device *dev, struct device_attribute *attr, char *buf)  \
+{                                                                                           \
+    struct mydma_dev *priv_dev = dev_get_drvdata(dev);                                      \
+    return sysfs_emit(buf, "%llu\n", mydma_stat_sum(priv_dev, offsetof(struct mydma_stats, field))); \
+}                                                                                           \
+static DEVICE_ATTR_RO(field)
+
+MYDMA_STAT_ATTR(submitted);
+MYDMA_STAT_ATTR(completed);
+MYDMA_STAT_ATTR(bytes);
+MYDMA_STAT_ATTR(ring_full);
+MYDMA_STAT_ATTR(timeouts);
+MYDMA_STAT_ATTR(irqs);
+MYDMA_STAT_ATTR(irq_completions);
+MYDMA_STAT_ATTR(resets);
+MYDMA_STAT_ATTR(crc_errors);
+
+// 平均每次中断回收的描述符个数
+static ssize_t completions_per_irq_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct mydma_dev *priv_dev = dev_get_drvdata(dev);
+    u64 irqs = mydma_stat_sum(priv_dev, offsetof(struct mydma_stats, irqs));
+    u64 reaped = mydma_stat_sum(priv_dev, offsetof(struct mydma_stats, irq_completions));
+
+    return sysfs_emit(buf, "%llu\n", irqs ? div64_u64(reaped, irqs) : 0);
+}
+static DEVICE_ATTR_RO(completions_per_irq);
+
+static struct attribute *mydma_stats_attrs[] = {
+    &dev_attr_submitted.attr,
+    &dev_attr_completed.attr,
+    &dev_attr_bytes.attr,
+    &dev_attr_ring_full.attr,
+    &dev_attr_timeouts.attr,
+    &dev_attr_irqs.attr,
+    &dev_attr_irq_completions.attr,
+    &dev_attr_completions_per_irq.attr,
+    &dev_attr_resets.attr,
+    &dev_attr_crc_errors.attr,
+    NULL,
+};
+
+// 计数器位于/sys/class/mydma/mydmaN/stats/下
+static const struct attribute_group mydma_stats_group = {
+    .name  = "stats",
+    .attrs = mydma_stats_attrs,
+};
+
+static ssize_t ring_size_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct mydma_dev *priv_dev = dev_get_drvdata(dev);
+
+    return sysfs_emit(buf, "%u\n", priv_dev->ring_size);
+}
+
+static ssize_t ring_size_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+    struct mydma_dev *priv_dev = dev_get_drvdata(dev);
+    u32 size;
+    int ret;
+
+    ret = kstrtou32(buf, 0, &size);
+    if (ret) return ret;
+    if (!is_power_of_2(size) || size < MYDMA_RING_MIN_SIZE || size > MYDMA_RING_MAX_SIZE) return -EINVAL;
+
+    ret = pm_runtime_resume_and_get(priv_dev->dev);
+    if (ret < 0) return ret;
+    mutex_lock(&priv_dev->cfg_lock);
+    ret = priv_dev->nr_open ? -EBUSY : mydma_set_ring_size(priv_dev, size);
+    mutex_unlock(&priv_dev->cfg_lock);
+    pm_runtime_mark_last_busy(priv_dev->dev);
+    pm_runtime_put_autosuspend(priv_dev->dev);
+    return ret ? ret : count;
+}
+static DEVICE_ATTR_RW(ring_size);
+
+// 单次write()允许的最大字节数，随ring_size变化
+static ssize_t max_transfer_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct mydma_dev *priv_dev = dev_get_drvdata(dev);
+
+    return sysfs_emit(buf, "%u\n", READ_ONCE(priv_dev->max_transfer));
+}
+static DEVICE_ATTR_RO(max_transfer);
+
+static struct attribute *mydma_attrs[] = {
+    &dev_attr_ring_size.attr,
+    &dev_attr_max_transfer.attr,
+    NULL,
+};
+
+static const struct attribute_group mydma_group = {
+    .attrs = mydma_attrs,
+};
+
+static const struct attribute_group *mydma_dev_groups[] = {
+    &mydma_group,
+    &mydma_stats_group,
+    NULL,
+};
+
+// debugfs中的latency_hist：每行一个非空的桶，"下界 上界 个数"，单位纳秒
+static int mydma_latency_hist_show(struct seq_file *m, void *v)
+{
+    struct mydma_dev *priv_dev = m->private;
+    u64 count;
+    int i;
+
+    for (i = 0; i < MYDMA_LAT_BUCKETS; i++) {
+        count = mydma_stat_sum(priv_dev, offsetof(struct mydma_stats, lat_hist[i]));
+        if (!count) continue;
+        if (i == MYDMA_LAT_BUCKETS - 1)
+            seq_printf(m, "%llu inf %llu\n", 1ULL << i, count);
+        else
+            seq_printf(m, "%llu %llu %llu\n", i ? 1ULL << i : 0, 1ULL << (i + 1), count);
+    }
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(mydma_latency_hist);
+
+static int mydma_chrdev_setup(struct mydma_dev *priv_dev)
+{
+    int ret, minor;
+    struct device *dev = priv_dev->dev;
+
+    // 先占住次设备号，设备节点建好之后才让open()找到设备
+    mutex_lock(&mydma_minor_lock);
+    minor = idr_alloc(&mydma_minor_idr, NULL, 0, MYDMA_MAX_DEVICES, GFP_KERNEL);
+    mutex_unlock(&mydma_minor_lock);
+    if (minor < 0) { dev_err(dev, "No free minor number\n"); return minor; }
+    priv_dev->dev_num = MKDEV(MAJOR(mydma_devt), minor);
+
+    priv_dev->cdev = cdev_alloc();
+    if (!priv_dev->cdev) { ret = -ENOMEM; goto err_free_minor; }
+    priv_dev->cdev->ops = &mydma_fops;
+    priv_dev->cdev->owner = THIS_MODULE;
+
+    ret = cdev_add(priv_dev->cdev, priv_dev->dev_num, 1);
+    if (ret) {
+        dev_err(dev, "Failed to add cdev\n");
+        kobject_put(&priv_dev->cdev->kobj);
+        priv_dev->cdev = NULL;
+        goto err_free_minor;
+    }
+
+    priv_dev->device = device_create_with_groups(mydma_class, dev, priv_dev->dev_num, priv_dev,
+                                                 mydma_dev_groups, DEVICE_NAME "%d", minor);
+    if (IS_ERR(priv_dev->device)) {
+        ret = PTR_ERR(priv_dev->device);
+        dev_err(dev, "Failed to create device node\n");
+        goto err_cdev_del;
+    }
+
+    // debugfs只用于调试，创建失败不影响驱动工作
+    priv_dev->debugfs_dir = debugfs_create_dir(dev_name(priv_dev->device), NULL);
+    debugfs_create_file("latency_hist", 0444, priv_dev->debugfs_dir, priv_dev, &mydma_latency_hist_fops);
+
+    mutex_lock(&mydma_minor_lock);
+    idr_replace(&mydma_minor_idr, priv_dev, minor);
+    mutex_unlock(&mydma_minor_lock);
+    pr_info("mydma: Character device created at /dev/%s\n", dev_name(priv_dev->device));
+    return 0;
+
+err_cdev_del:
+    cdev_del(priv_dev->cdev);
+    priv_dev->cdev = NULL;
+err_free_minor:
+    mutex_lock(&mydma_minor_lock);
+    idr_remove(&mydma_minor_idr, minor);
+    mutex_unlock(&mydma_minor_lock);
+    priv_dev->dev_num = 0;
+    return ret;
+}
+
+static void mydma_chrdev_cleanup(struct mydma_dev *priv_dev)
+{
+    if (!priv_dev) return;
+    if (priv_dev->dev_num) {
+        mutex_lock(&mydma_minor_lock);
+        idr_remove(&mydma_minor_idr, MINOR(priv_dev->dev_num));
+        mutex_unlock(&mydma_minor_lock);
+    }
+    debugfs_remove_recursive(priv_dev->debugfs_dir);
+    if (priv_dev->device) device_destroy(mydma_class, priv_dev->dev_num);
+    if (priv_dev->cdev) cdev_del(priv_dev->cdev);
+    pr_info("mydma: Character device cleaned up\n");
+}
+
+// 硬中断只屏蔽本队列的中断并唤醒中断线程，回收工作全部在线程中完成
+static irqreturn_t mydma_irq_handler(int irq, void *dev)
+{
+    struct mydma_queue *q = (struct mydma_queue *)dev;
+
+    mydma_stat_inc(q->priv_dev, irqs);
+    trace_mydma_irq(q->qid);
+
+    writel(0, q->regs + MYDMA_REG_INT_ENABLE);
+    return IRQ_WAKE_THREAD;
+}
+
+// 中断线程：在中断屏蔽期间按预算轮询回收，直到环形缓冲区中没有新的完成，再重新打开中断
+// 使共享CQ中的完成事件无需系统调用即可被用户看到，高负载下一次中断可以处理大量完成
+static irqreturn_t mydma_irq_thread(int irq, void *dev)
+{
+    struct mydma_queue *q = (struct mydma_queue *)dev;
+    u32 budget = max_t(u32, READ_ONCE(irq_budget), 1);
+    u32 reaped;
+    bool pending;
+
+    for (;;) {
+        do {
+            spin_lock(&q->ring_lock);
+            reaped = mydma_reap_budget_locked(q, budget);
+            spin_unlock(&q->ring_lock);
+            mydma_stat_add(q->priv_dev, irq_completions, reaped);
+
+            if (reaped == budget)
+                cond_resched(); // 预算用完说明仍有积压，让出CPU后继续轮询
+        } while (reaped == budget);
+
+        // 有忙轮询者时保持屏蔽，由最后一个轮询者重新打开
+        if (atomic_read(&q->pollers))
+            break;
+        writel(1, q->regs + MYDMA_REG_INT_ENABLE);
+        readl(q->regs + MYDMA_REG_INT_ENABLE); // 刷新posted写，确保中断已打开再检查
+
+        // 重新打开中断前刚完成的描述符可能不会再触发中断，再检查一次
+        spin_lock(&q->ring_lock);
+        pending = mydma_desc_done_locked(q) || mydma_ooo_pending(q);
+        spin_unlock(&q->ring_lock);
+        if (!pending)
+            break;
+        writel(0, q->regs + MYDMA_REG_INT_ENABLE);
+    }
+    return IRQ_HANDLED;
+}
+
+// 分配深度为size的描述符环和软件上下文数组
+// 描述符环由DMA层分配在设备所在的NUMA节点上，上下文数组也分配在该节点
+static int mydma_ring_mem_alloc(struct mydma_dev *priv_dev, u32 size, struct mydma_ring_mem *mem)
+{
+    mem->virt_addr = dma_alloc_coherent(priv_dev->dev, size * priv_dev->desc_size,
+                                        &mem->dma_addr, GFP_KERNEL);
+    if (!mem->virt_addr) return -ENOMEM;
+    // 深的环形缓冲区上下文数组可能超过几个页，不要求物理连续
+    mem->ctx = kvzalloc_node(array_size(size, sizeof(struct dma_context)), GFP_KERNEL,
+                             dev_to_node(priv_dev->dev));
+    if (!mem->ctx) {
+        dma_free_coherent(priv_dev->dev, size * priv_dev->desc_size, mem->virt_addr, mem->dma_addr);
+        mem->virt_addr = NULL;
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+static void mydma_ring_mem_free(struct mydma_dev *priv_dev, u32 size, struct mydma_ring_mem *mem)
+{
+    if (mem->virt_addr)
+        dma_free_coherent(priv_dev->dev, size * priv_dev->desc_size, mem->virt_addr, mem->dma_addr);
+    kvfree(mem->ctx);
+}
+
+// 让队列使用新的描述符环并把它交给硬件，队列必须空闲；设备在写RING_ADDR_LO时复位该队列的头尾指针
+static void mydma_queue_set_ring(struct mydma_queue *q, u32 size, struct mydma_ring_mem *mem)
+{
+    q->ring_size = size;
+    q->ring_mask = size - 1;
+    q->ring_buffer_size = size * q->priv_dev->desc_size;
+    q->ring_buffer_virt_addr = mem->virt_addr;
+    q->ring_buffer_dma_addr = mem->dma_addr;
+    q->dma_ctx_ring = mem->ctx;
+    atomic_set(&q->res_tail, 0);
+    q->queue_head = 0;
+    q->queue_tail = 0;
+    q->hw_head_shadow = 0;
+
+    writel(upper_32_bits(q->ring_buffer_dma_addr), q->regs + MYDMA_REG_RING_ADDR_HI);
+    writel(lower_32_bits(q->ring_buffer_dma_addr), q->regs + MYDMA_REG_RING_ADDR_LO);
+    if (q->priv_dev->mock) mydma_mock_ring_reset(q->priv_dev->mock, q->qid);
+}
+
+// 仲裁设置：普通队列权重为1，高优先级队列按hiprio_weight加权，为0时严格优先
+static void mydma_queue_set_arb(struct mydma_queue *q)
+{
+    u32 arb = 1;
+
+    if (!(q->priv_dev->caps & MYDMA_CAP_QUEUE_ARB)) return;
+    if (q->hiprio)
+        arb = hiprio_weight ? min_t(u32, hiprio_weight, MYDMA_ARB_WEIGHT_MASK) : MYDMA_ARB_STRICT | 1;
+    writel(arb, q->regs + MYDMA_REG_QUEUE_ARB);
+}
+
+// 选择描述符格式：设备支持时使用64字节格式；desc_wc打开且设备提供写合并窗口时，
+// 把BAR2以pci_iomap_wc()映射，描述符直接写入设备，每个队列的窗口要放得下整个环形缓冲区
+static void mydma_setup_desc_format(struct mydma_dev *priv_dev)
+{
+    struct pci_dev *pdev = priv_dev->pdev;
+    u32 fmt, stride;
+
+    priv_dev->desc_size = sizeof(struct dma_descriptor);
+    if (!(priv_dev->caps & MYDMA_CAP_DESC64)) {
+        if (desc_wc) dev_info(priv_dev->dev, "Device has no 64-byte descriptor format, desc_wc ignored\n");
+        return;
+    }
+    priv_dev->desc64 = true;
+    priv_dev->desc_size = sizeof(struct mydma_desc64);
+    fmt = MYDMA_DESC_FMT_64;
+    if (priv_dev->caps & MYDMA_CAP_INLINE)
+        priv_dev->inline_max = min_t(u32, inline_max, MYDMA_INLINE_MAX);
+    priv_dev->crc_hw = priv_dev->caps & MYDMA_CAP_CRC32C;
+
+    stride = readl(priv_dev->bar0_virt_addr + MYDMA_REG_WC_QUEUE_STRIDE);
+    if (desc_wc && stride && pdev &&
+        (u64)stride * priv_dev->nr_queues <= pci_resource_len(pdev, MYDMA_WC_BAR) &&
+        (u64)priv_dev->ring_size * priv_dev->desc_size <= stride)
+        priv_dev->wc_base = pci_iomap_wc(pdev, MYDMA_WC_BAR, 0);
+    if (priv_dev->wc_base) {
+        priv_dev->wc_stride = stride;
+        fmt |= MYDMA_DESC_FMT_WC;
+    } else if (desc_wc) {
+        dev_info(priv_dev->dev, "Write-combined descriptor window not available\n");
+    }
+
+    writel(fmt, priv_dev->bar0_virt_addr + MYDMA_REG_DESC_FORMAT);
+    pr_info("mydma: Using 64-byte descriptors%s%s%s\n", priv_dev->wc_base ? " via write-combined BAR" : "",
+            priv_dev->inline_max ? " with inline payloads" : "", priv_dev->crc_hw ? ", CRC32C offload" : "");
+}
+
+// 单次传输最多占用一半的队列分片，且拆出的描述符必须能一次放进环形缓冲区
+static void mydma_update_max_transfer(struct mydma_dev *priv_dev)
+{
+    priv_dev->max_transfer = min_t(size_t, (size_t)priv_dev->queues[0].nr_bufs * MYDMA_POOL_BUF_SIZE / 2,
+                                   (size_t)(priv_dev->ring_size - 1) * MYDMA_DESC_MAX_LEN);
+    priv_dev->max_transfer = max_t(u32, priv_dev->max_transfer, MYDMA_POOL_BUF_SIZE);
+}
+
+// 初始化一个硬件队列：设置环形缓冲区深度，分配环形缓冲区和软件上下文，划出缓冲池分片，
+// 并把环形缓冲区地址写入该队列的寄存器组
+static int mydma_queue_init(struct mydma_dev *priv_dev, u32 qid, u32 nr_bufs)
+{
+    struct mydma_queue *q = &priv_dev->queues[qid];
+    struct device *dev = priv_dev->dev;
+    struct mydma_ring_mem mem;
+
+    q->priv_dev = priv_dev;
+    q->qid = qid;
+    q->regs = priv_dev->bar0_virt_addr + qid * MYDMA_QUEUE_REG_STRIDE;
+    q->desc64 = priv_dev->desc64;
+    q->hiprio = qid >= priv_dev->nr_queues - priv_dev->nr_hiprio;
+    q->wc_ring = priv_dev->wc_base ? priv_dev->wc_base + qid * priv_dev->wc_stride : NULL;
+    mydma_queue_set_arb(q);
+
+    writel(priv_dev->ring_size, q->regs + MYDMA_REG_RING_SIZE);
+    if (readl(q->regs + MYDMA_REG_RING_SIZE) != priv_dev->ring_size) { dev_err(dev, "Queue %u ring size mismatch\n", qid); return -EIO; }
+
+    if (mydma_ring_mem_alloc(priv_dev, priv_dev->ring_size, &mem)) { dev_err(dev, "Queue %u ring buffer alloc failed\n", qid); return -ENOMEM; }
+    mydma_queue_set_ring(q, priv_dev->ring_size, &mem);
+
+    q->buf_base = qid * nr_bufs;
+    q->nr_bufs = nr_bufs;
+    q->pool_bitmap = kcalloc(BITS_TO_LONGS(nr_bufs), sizeof(unsigned long), GFP_KERNEL);
+    if (!q->pool_bitmap) return -ENOMEM;
+
+    spin_lock_init(&q->ring_lock);
+    spin_lock_init(&q->db_lock);
+    atomic_set(&q->pollers, 0);
+    atomic_set(&q->inline_nr, 0);
+    atomic_set(&q->pm_users, 0);
+    mutex_init(&q->pm_lock);
+    INIT_DELAYED_WORK(&q->pm_idle, mydma_queue_pm_idle);
+    INIT_LIST_HEAD(&q->direct_orphans);
+    INIT_LIST_HEAD(&q->wake_list);
+    init_waitqueue_head(&q->space_wait_queue);
+    pr_info("mydma: Queue %u%s: ring dma_addr=0x%pad, buffers %u-%u\n", qid, q->hiprio ? " (high priority)" : "",
+            &q->ring_buffer_dma_addr, q->buf_base, q->buf_base + nr_bufs - 1);
+    return 0;
+}
+
+// 释放所有队列的环形缓冲区，其余成员在最后一个引用放下时释放(mydma_dev_release())
+static void mydma_queues_free(struct mydma_dev *priv_dev)
+{
+    struct mydma_queue *q;
+    u32 i;
+
+    for (i = 0; i < priv_dev->nr_queues; i++) {
+        q = &priv_dev->queues[i];
+        if (q->ring_buffer_virt_addr)
+            dma_free_coherent(priv_dev->dev, q->ring_buffer_size, q->ring_buffer_virt_addr, q->ring_buffer_dma_addr);
+        kvfree(q->dma_ctx_ring);
+    }
+}
+
+// 把所有队列的环形缓冲区换成深度为size的新环；调用者需持有cfg_lock并保证没有打开的文件。
+// 先分配好全部新环，再停掉中断线程确认所有队列都已空闲，最后逐个替换；任何一步失败都保留原来的环
+static int mydma_set_ring_size(struct mydma_dev *priv_dev, u32 size)
+{
+    u32 old_size = priv_dev->ring_size;
+    struct mydma_ring_mem *mem, old;
+    struct mydma_queue *q;
+    bool idle = true;
+    u32 i, n;
+    int ret = 0;
+
+    if (size == old_size) return 0;
+    if (priv_dev->wc_base && (u64)size * priv_dev->desc_size > priv_dev->wc_stride) return -EINVAL;
+
+    mem = kcalloc(priv_dev->nr_queues, sizeof(*mem), GFP_KERNEL);
+    if (!mem) return -ENOMEM;
+    for (n = 0; n < priv_dev->nr_queues; n++) {
+        ret = mydma_ring_mem_alloc(priv_dev, size, &mem[n]);
+        if (ret) goto out_free;
+    }
+
+    // 没有打开的文件就没有新的提交，中断线程停掉后也不会再有回收
+    for (i = 0; i < priv_dev->nr_queues; i++)
+        disable_irq(priv_dev->queues[i].irq);
+    for (i = 0; i < priv_dev->nr_queues && idle; i++) {
+        q = &priv_dev->queues[i];
+        spin_lock(&q->ring_lock);
+        mydma_reap_locked(q);
+        idle = q->queue_head == q->queue_tail && atomic_read(&q->res_tail) == q->queue_tail;
+        spin_unlock(&q->ring_lock);
+    }
+    if (!idle) { ret = -EBUSY; goto out_enable_irq; }
+
+    // 设备不接受这个深度时，把已经改过的队列恢复原状
+    for (i = 0; i < priv_dev->nr_queues; i++) {
+        q = &priv_dev->queues[i];
+        writel(size, q->regs + MYDMA_REG_RING_SIZE);
+        if (readl(q->regs + MYDMA_REG_RING_SIZE) != size) { ret = -EINVAL; break; }
+    }
+    if (ret) {
+        dev_warn(priv_dev->dev, "Device rejected ring size %u\n", size);
+        for (n = 0; n <= i && n < priv_dev->nr_queues; n++)
+            writel(old_size, priv_dev->queues[n].regs + MYDMA_REG_RING_SIZE);
+        n = priv_dev->nr_queues;
+        goto out_enable_irq;
+    }
+
+    // 替换后mem[]里留下旧环，统一在下面释放
+    for (i = 0; i < priv_dev->nr_queues; i++) {
+        q = &priv_dev->queues[i];
+        old.virt_addr = q->ring_buffer_virt_addr;
+        old.dma_addr = q->ring_buffer_dma_addr;
+        old.ctx = q->dma_ctx_ring;
+        mydma_queue_set_ring(q, size, &mem[i]);
+        mem[i] = old;
+    }
+    priv_dev->ring_size = size;
+    mydma_update_max_transfer(priv_dev);
+    dev_info(priv_dev->dev, "Ring size changed from %u to %u\n", old_size, size);
+
+out_enable_irq:
+    for (i = 0; i < priv_dev->nr_queues; i++)
+        enable_irq(priv_dev->queues[i].irq);
+out_free:
+    for (i = 0; i < n; i++)
+        mydma_ring_mem_free(priv_dev, ret ? size : old_size, &mem[i]);
+    kfree(mem);
+    return ret;
+}
+
+// 复位设备：所有队列的环形缓冲区地址、头尾指针、中断使能和仲裁设置，以及描述符格式、中断合并设置都恢复为默认值
+static void mydma_reset_device(struct mydma_dev *priv_dev)
+{
+    writel(0x80000000, priv_dev->bar0_virt_addr + MYDMA_REG_DEV_RESET);
+    if (priv_dev->mock) mydma_mock_reset(priv_dev->mock);
+}
+
+// 复位后重新写入设备级的设置：描述符格式和中断合并
+static void mydma_restore_device(struct mydma_dev *priv_dev)
+{
+    if (priv_dev->desc64)
+        writel(MYDMA_DESC_FMT_64 | (priv_dev->wc_base ? MYDMA_DESC_FMT_WC : 0),
+               priv_dev->bar0_virt_addr + MYDMA_REG_DESC_FORMAT);
+    if (priv_dev->caps & MYDMA_CAP_INT_COAL) {
+        writel(coal_count, priv_dev->bar0_virt_addr + MYDMA_REG_INT_COAL_COUNT);
+        writel(coal_usecs, priv_dev->bar0_virt_addr + MYDMA_REG_INT_COAL_USECS);
+    }
+}
+
+// 把描述符环重新交给复位过的设备，队列上不能再有在途描述符；调用者持有ring_lock和db_lock。同时清除MYDMA_RES_STOPPED。
+// 中止过描述符的环里，旧的status可能恰好与槽位下一轮的相位相符，要把描述符环和上下文一起清零；
+// drained表示所有描述符都已由设备完成，每个槽位的status都是上一轮的相位，可以原样复用
+static void mydma_queue_restart(struct mydma_queue *q, bool drained)
+{
+    struct mydma_ring_mem mem;
+
+    if (!drained) {
+        memset(q->ring_buffer_virt_addr, 0, q->ring_buffer_size);
+        memset(q->dma_ctx_ring, 0, array_size(q->ring_size, sizeof(struct dma_context)));
+    }
+    mem.virt_addr = q->ring_buffer_virt_addr;
+    mem.dma_addr = q->ring_buffer_dma_addr;
+    mem.ctx = q->dma_ctx_ring;
+    writel(q->ring_size, q->regs + MYDMA_REG_RING_SIZE);
+    mydma_queue_set_ring(q, q->ring_size, &mem);
+    mydma_queue_set_arb(q);
+    q->wd_head = 0;
+    q->wd_since_ns = ktime_get_ns();
+}
+
+// 已发布的尾指针到res_tail之间保留的槽位是否都已填好
+static bool mydma_slots_filled(struct mydma_queue *q)
+{
+    u32 end = atomic_read(&q->res_tail) & ~MYDMA_RES_STOPPED;
+    u32 slot;
+
+    for (slot = smp_load_acquire(&q->queue_tail); slot != end; slot = (slot + 1) & q->ring_mask) {
+        if (smp_load_acquire(&q->dma_ctx_ring[slot].state) != MYDMA_SLOT_READY) return false;
+    }
+    return true;
+}
+
+// 挡住新的槽位保留，等已保留槽位的提交者填好描述符，并替它们敲门铃发布(错误恢复期间门铃不访问设备，只等它们填好)。
+// 提交者在填好描述符之前不会睡眠，返回是否在MYDMA_RESET_QUIESCE_MS内等到；
+// 无论成败MYDMA_RES_STOPPED都保持置位，由调用者决定是否撤销
+static bool mydma_stop_submits(struct mydma_dev *priv_dev)
+{
+    struct mydma_queue *q;
+    bool quiesced = false;
+    u32 i, t;
+
+    for (i = 0; i < priv_dev->nr_queues; i++)
+        atomic_or(MYDMA_RES_STOPPED, &priv_dev->queues[i].res_tail);
+
+    for (t = 0; t < MYDMA_RESET_QUIESCE_MS && !quiesced; t++) {
+        if (t) msleep(1);
+        quiesced = true;
+        for (i = 0; i < priv_dev->nr_queues; i++) {
+            q = &priv_dev->queues[i];
+            mydma_ring_doorbell(q);
+            if (!mydma_slots_filled(q)) quiesced = false;
+        }
+    }
+    return quiesced;
+}
+
+// 复位设备，以-EIO中止所有在途描述符，再把清空的环形缓冲区重新交给设备；
+// 调用者已用mydma_stop_submits()停住提交者，并停掉了中断线程
+static void mydma_rebuild(struct mydma_dev *priv_dev)
+{
+    struct dma_context *ctx;
+    struct mydma_queue *q;
+    u32 i, slot, end;
+
+    mydma_reset_device(priv_dev);
+    mydma_restore_device(priv_dev);
+
+    for (i = 0; i < priv_dev->nr_queues; i++) {
+        q = &priv_dev->queues[i];
+        spin_lock(&q->ring_lock);
+        spin_lock(&q->db_lock);
+        // 设备已复位，不会再访问这些描述符；乱序完成的早已投递，不再重复。
+        // 错误恢复期间填好、没有发布给设备的槽位(READY)同样以-EIO中止
+        end = atomic_read(&q->res_tail) & ~MYDMA_RES_STOPPED;
+        for (slot = q->queue_head; slot != end; slot = (slot + 1) & q->ring_mask) {
+            ctx = &q->dma_ctx_ring[slot];
+            if (ctx->state == MYDMA_SLOT_READY) ctx->submit_ns = ktime_get_ns();
+            if (ctx->state == MYDMA_SLOT_INFLIGHT || ctx->state == MYDMA_SLOT_READY)
+                mydma_complete_desc_locked(q, slot, -EIO);
+        }
+        mydma_wake_files_locked(q);
+
+        mydma_queue_restart(q, false);
+        spin_unlock(&q->db_lock);
+        spin_unlock(&q->ring_lock);
+
+        // 有忙轮询者时保持屏蔽，由最后一个轮询者重新打开
+        writel(atomic_read(&q->pollers) ? 0 : 1, q->regs + MYDMA_REG_INT_ENABLE);
+    }
+}
+
+// 唤醒在复位或解绑期间保留不到槽位的写者；被中止传输的等待者已由mydma_rebuild()唤醒
+static void mydma_wake_all(struct mydma_dev *priv_dev)
+{
+    u32 i;
+
+    for (i = 0; i < priv_dev->nr_queues; i++)
+        mydma_wake_space(&priv_dev->queues[i]);
+}
+
+// 复位设备并重建所有队列，不需要重新加载模块：挡住新的槽位保留，等已保留的描述符发布，停掉中断线程，
+// 复位设备后以-EIO中止所有在途描述符，再把清空的环形缓冲区重新交给设备。
+// 已保留槽位的提交者在填好描述符之前不会睡眠，等不到它们时放弃复位，留待看门狗下一次检查
+static void mydma_recover(struct mydma_dev *priv_dev)
+{
+    u32 i;
+
+    mutex_lock(&priv_dev->cfg_lock);
+    if (!mydma_stop_submits(priv_dev)) {
+        dev_warn(priv_dev->dev, "Submitters still filling descriptors, device reset postponed\n");
+        for (i = 0; i < priv_dev->nr_queues; i++)
+            atomic_andnot(MYDMA_RES_STOPPED, &priv_dev->queues[i].res_tail);
+        goto out;
+    }
+
+    for (i = 0; i < priv_dev->nr_queues; i++)
+        disable_irq(priv_dev->queues[i].irq);
+    mydma_rebuild(priv_dev);
+    for (i = 0; i < priv_dev->nr_queues; i++)
+        enable_irq(priv_dev->queues[i].irq);
+    mydma_stat_inc(priv_dev, resets);
+    dev_warn(priv_dev->dev, "Device reset, in-flight transfers aborted with -EIO\n");
+
+out:
+    mydma_wake_all(priv_dev);
+    mutex_unlock(&priv_dev->cfg_lock);
+}
+
+// 队列是否卡住：有在途描述符，queue_head从上次检查起一直没有前进，并且超过了按队列头描述符的长度推算的超时。
+// 先回收一次，丢失的中断不算卡住
+static bool mydma_queue_stuck(struct mydma_queue *q, u64 now)
+{
+    struct dma_context *ctx;
+    bool stuck = false;
+
+    spin_lock(&q->ring_lock);
+    mydma_reap_locked(q);
+    if (q->queue_head == q->queue_tail || q->queue_head != q->wd_head) {
+        q->wd_head = q->queue_head;
+        q->wd_since_ns = now;
+    } else {
+        // 环形缓冲区转过一整圈时queue_head可能恰好相同，以提交时间区分
+        ctx = &q->dma_ctx_ring[q->queue_head];
+        stuck = now - max(q->wd_since_ns, ctx->submit_ns) > (u64)mydma_expected_ms(q, ctx->size) * NSEC_PER_MSEC;
+    }
+    spin_unlock(&q->ring_lock);
+    return stuck;
+}
+
+// 看门狗：周期性检查各队列，发现卡住的队列就复位设备。复位是整个设备的，一次检查最多复位一次
+static void mydma_watchdog(struct work_struct *work)
+{
+    struct mydma_dev *priv_dev = container_of(to_delayed_work(work), struct mydma_dev, watchdog);
+    u64 now = ktime_get_ns();
+    u32 i;
+
+    for (i = 0; i < priv_dev->nr_queues; i++) {
+        if (!mydma_queue_stuck(&priv_dev->queues[i], now)) continue;
+        dev_warn(priv_dev->dev, "Queue %u stuck at descriptor %u, resetting device\n",
+                 i, READ_ONCE(priv_dev->queues[i].queue_head));
+        mydma_recover(priv_dev);
+        break;
+    }
+    schedule_delayed_work(&priv_dev->watchdog, msecs_to_jiffies(watchdog_ms));
+}
+
+// 运行时挂起：所有队列都已释放设备引用，不会有在途描述符。只停掉看门狗、关闭各队列的中断，
+// 配置空间的保存和D3hot由PCI核心完成；描述符环、缓冲池和中断向量保持不变
+static int mydma_runtime_suspend(struct device *dev)
+{
+    struct mydma_dev *priv_dev = dev_get_drvdata(dev);
+    struct mydma_queue *q;
+    u32 i;
+
+    for (i = 0; i < priv_dev->nr_queues; i++) {
+        if (!mydma_queue_idle(&priv_dev->queues[i])) return -EBUSY;
+    }
+
+    cancel_delayed_work_sync(&priv_dev->watchdog);
+    for (i = 0; i < priv_dev->nr_queues; i++) {
+        q = &priv_dev->queues[i];
+        synchronize_irq(q->irq); // 中断线程最后会重新打开中断，等它结束再关
+        writel(0, q->regs + MYDMA_REG_INT_ENABLE);
+    }
+    return 0;
+}
+
+// 运行时恢复：回到D0的设备可能已丢失寄存器内容(PMCSR的No_Soft_Reset为0)，回读队列0的环形缓冲区地址来判断。
+// 丢失时复位设备并重写寄存器，把已排空的描述符环重新交给它；没有丢失时只需重新打开中断
+static int mydma_runtime_resume(struct device *dev)
+{
+    struct mydma_dev *priv_dev = dev_get_drvdata(dev);
+    struct mydma_queue *q = &priv_dev->queues[0];
+    u32 i;
+
+    if (readl(q->regs + MYDMA_REG_RING_ADDR_LO) != lower_32_bits(q->ring_buffer_dma_addr) ||
+        readl(q->regs + MYDMA_REG_RING_ADDR_HI) != upper_32_bits(q->ring_buffer_dma_addr)) {
+        dev_dbg(dev, "Device lost its registers while suspended, reprogramming\n");
+        mydma_reset_device(priv_dev);
+        mydma_restore_device(priv_dev);
+        for (i = 0; i < priv_dev->nr_queues; i++) {
+            q = &priv_dev->queues[i];
+            spin_lock(&q->ring_lock);
+            spin_lock(&q->db_lock);
+            mydma_queue_restart(q, true);
+            spin_unlock(&q->db_lock);
+            spin_unlock(&q->ring_lock);
+        }
+    }
+
+    for (i = 0; i < priv_dev->nr_queues; i++) {
+        q = &priv_dev->queues[i];
+        writel(atomic_read(&q->pollers) ? 0 : 1, q->regs + MYDMA_REG_INT_ENABLE);
+    }
+    if (watchdog_ms) schedule_delayed_work(&priv_dev->watchdog, msecs_to_jiffies(watchdog_ms));
+    return 0;
+}
+
+// 解绑前排空：挡住新的提交，在按在途描述符推算的时间内等待它们完成(中断照常回收，这里也顺便回收)，
+// 返回是否全部完成。设备已从总线上断开时不必等待
+static bool mydma_drain(struct mydma_dev *priv_dev)
+{
+    unsigned long deadline;
+    struct mydma_queue *q;
+    u32 i, ms = 0;
+    bool idle = false;
+
+    WRITE_ONCE(priv_dev->dying, true);
+    mydma_wake_all(priv_dev);
+    if (!mydma_stop_submits(priv_dev)) return false;
+    if (priv_dev->pdev && pci_channel_offline(priv_dev->pdev)) return false;
+
+    for (i = 0; i < priv_dev->nr_queues; i++) {
+        q = &priv_dev->queues[i];
+        ms = max(ms, mydma_expected_ms(q, (u64)((q->queue_tail - q->queue_head) & q->ring_mask) * MYDMA_DESC_MAX_LEN));
+    }
+
+    deadline = jiffies + msecs_to_jiffies(ms);
+    for (;;) {
+        idle = true;
+        for (i = 0; i < priv_dev->nr_queues; i++) {
+            q = &priv_dev->queues[i];
+            spin_lock(&q->ring_lock);
+            mydma_reap_locked(q);
+            if (q->queue_head != q->queue_tail) idle = false;
+            spin_unlock(&q->ring_lock);
+        }
+        if (idle || time_after(jiffies, deadline)) break;
+        msleep(1);
+    }
+
+    if (!idle) dev_warn(priv_dev->dev, "Transfers still in flight after %u ms, resetting device\n", ms);
+    return idle;
+}
+
+// 停下中断线程、看门狗、门铃和新的提交，设备在复位之前不可访问
+static void mydma_err_freeze(struct mydma_dev *priv_dev)
+{
+    struct mydma_queue *q;
+    u32 i;
+
+    if (priv_dev->err_frozen) return;
+    WRITE_ONCE(priv_dev->err_frozen, true);
+    cancel_delayed_work_sync(&priv_dev->watchdog);
+    for (i = 0; i < priv_dev->nr_queues; i++) {
+        q = &priv_dev->queues[i];
+        atomic_or(MYDMA_RES_STOPPED, &q->res_tail);
+        disable_irq(q->irq);
+        // 等正在敲门铃的提交者写完尾指针，之后的门铃都不再访问设备
+        spin_lock(&q->db_lock);
+        spin_unlock(&q->db_lock);
+    }
+}
+
+// 设备复位之后重建队列，在途传输以-EIO结束；已保留槽位的提交者等不到时放弃，由调用者决定重试或标记设备失效
+static bool mydma_err_rebuild(struct mydma_dev *priv_dev)
+{
+    bool ok;
+
+    mutex_lock(&priv_dev->cfg_lock);
+    ok = mydma_stop_submits(priv_dev);
+    if (ok) mydma_rebuild(priv_dev);
+    mutex_unlock(&priv_dev->cfg_lock);
+    if (!ok) {
+        dev_err(priv_dev->dev, "Submitters still filling descriptors, cannot rebuild queues\n");
+        return false;
+    }
+    mydma_stat_inc(priv_dev, resets);
+    return true;
+}
+
+static void mydma_err_thaw(struct mydma_dev *priv_dev)
+{
+    u32 i;
+
+    if (!priv_dev->err_frozen) return;
+    WRITE_ONCE(priv_dev->err_frozen, false);
+    for (i = 0; i < priv_dev->nr_queues; i++) {
+        enable_irq(priv_dev->queues[i].irq);
+        mydma_ring_doorbell(&priv_dev->queues[i]); // 发布重建之后、解冻之前填好的槽位
+    }
+    // 运行时挂起的设备由mydma_runtime_resume()重新启动看门狗
+    if (watchdog_ms && !pm_runtime_suspended(priv_dev->dev)) schedule_delayed_work(&priv_dev->watchdog, msecs_to_jiffies(watchdog_ms));
+    mydma_wake_all(priv_dev);
+}
+
+// 设备复位之后重建不了队列：环形缓冲区地址没有重新设置，保持冻结，不再打开中断和门铃。
+// 按解绑处理，之后的文件操作返回-ENODEV；已发布的在途描述符设备不会再完成，以-EIO中止，只能解绑设备
+static void mydma_err_dead(struct mydma_dev *priv_dev)
+{
+    struct mydma_file *mfile;
+    struct mydma_queue *q;
+    u32 i, slot;
+
+    dev_err(priv_dev->dev, "Queues not rebuilt after reset, device is dead until rebound\n");
+    WRITE_ONCE(priv_dev->dying, true);
+    for (i = 0; i < priv_dev->nr_queues; i++) {
+        q = &priv_dev->queues[i];
+        spin_lock(&q->ring_lock);
+        for (slot = q->queue_head; slot != q->queue_tail; slot = (slot + 1) & q->ring_mask) {
+            if (q->dma_ctx_ring[slot].state == MYDMA_SLOT_INFLIGHT)
+                mydma_complete_desc_locked(q, slot, -EIO);
+        }
+        // 之后的回收和排空都不再看这些槽位
+        smp_store_release(&q->queue_head, q->queue_tail);
+        mydma_wake_files_locked(q);
+        spin_unlock(&q->ring_lock);
+    }
+    mydma_wake_all(priv_dev);
+
+    mutex_lock(&priv_dev->cfg_lock);
+    list_for_each_entry(mfile, &priv_dev->files, node)
+        wake_up(&mfile->wait);
+    mutex_unlock(&priv_dev->cfg_lock);
+}
+
+// 链路冻结时请求复位；可恢复的错误不影响设备，照常运行；永久故障交给remove
+static pci_ers_result_t mydma_error_detected(struct pci_dev *pdev, pci_channel_state_t state)
+{
+    struct mydma_dev *priv_dev = pci_get_drvdata(pdev);
+
+    dev_warn(&pdev->dev, "PCI error detected, channel state %d\n", state);
+    if (state == pci_channel_io_normal) return PCI_ERS_RESULT_CAN_RECOVER;
+    if (state == pci_channel_io_perm_failure) return PCI_ERS_RESULT_DISCONNECT;
+
+    mydma_err_freeze(priv_dev);
+    pci_disable_device(pdev);
+    return PCI_ERS_RESULT_NEED_RESET;
+}
+
+static pci_ers_result_t mydma_slot_reset(struct pci_dev *pdev)
+{
+    struct mydma_dev *priv_dev = pci_get_drvdata(pdev);
+
+    if (pci_enable_device(pdev)) {
+        dev_err(&pdev->dev, "pci_enable_device after reset failed\n");
+        mydma_err_dead(priv_dev);
+        return PCI_ERS_RESULT_DISCONNECT;
+    }
+    pci_set_master(pdev);
+    pci_restore_state(pdev);
+    pci_save_state(pdev);
+
+    if (!mydma_err_rebuild(priv_dev)) {
+        mydma_err_dead(priv_dev);
+        return PCI_ERS_RESULT_DISCONNECT;
+    }
+    dev_info(&pdev->dev, "Recovered from PCI error, in-flight transfers aborted with -EIO\n");
+    return PCI_ERS_RESULT_RECOVERED;
+}
+
+static void mydma_io_resume(struct pci_dev *pdev)
+{
+    mydma_err_thaw(pci_get_drvdata(pdev));
+}
+
+// 功能级复位(如写/sys/bus/pci/devices/*/reset)：PCI核心负责保存和恢复配置空间
+static void mydma_reset_prepare(struct pci_dev *pdev)
+{
+    mydma_err_freeze(pci_get_drvdata(pdev));
+}
+
+static void mydma_reset_done(struct pci_dev *pdev)
+{
+    struct mydma_dev *priv_dev = pci_get_drvdata(pdev);
+
+    // 提交者填描述符时不会睡眠，等不到多半只是被抢占，再试一次；仍然失败时保持冻结
+    if (!mydma_err_rebuild(priv_dev) && !mydma_err_rebuild(priv_dev)) {
+        mydma_err_dead(priv_dev);
+        return;
+    }
+    mydma_err_thaw(priv_dev);
+}
+
+// 按各普通队列中断向量的亲和性建立CPU到队列的映射，未被任何向量覆盖的CPU轮流分配
+static void mydma_map_cpus(struct mydma_dev *priv_dev)
+{
+    u32 i, nr = priv_dev->nr_queues - priv_dev->nr_hiprio;
+    const struct cpumask *mask;
+    unsigned int cpu;
+
+    for_each_possible_cpu(cpu)
+        priv_dev->cpu_queue[cpu] = cpu % nr;
+
+    for (i = 0; i < nr; i++) {
+        mask = priv_dev->pdev ? pci_irq_get_affinity(priv_dev->pdev, i) : NULL;
+        if (!mask) continue;
+        for_each_cpu(cpu, mask)
+            priv_dev->cpu_queue[cpu] = i;
+    }
+}
+
+// 分配设备私有数据，PCI设备和模拟设备共用。解绑时仍打开的文件和导出的dma-buf还在引用它，
+// 因此不挂在dev上，由mydma_dev_put()在最后一个引用放下时释放
+static struct mydma_dev *mydma_dev_alloc(struct device *dev)
+{
+    struct mydma_dev *priv_dev;
+
+    priv_dev = kzalloc_node(sizeof(struct mydma_dev), GFP_KERNEL, dev_to_node(dev));
+    if (!priv_dev) return NULL;
+
+    priv_dev->stats = alloc_percpu(struct mydma_stats);
+    if (!priv_dev->stats) goto err_free;
+    if (init_srcu_struct(&priv_dev->srcu)) goto err_free_stats;
+    priv_dev->dev = get_device(dev);
+    kref_init(&priv_dev->ref);
+    mutex_init(&priv_dev->cfg_lock);
+    INIT_LIST_HEAD(&priv_dev->files);
+    INIT_DELAYED_WORK(&priv_dev->watchdog, mydma_watchdog);
+    return priv_dev;
+
+err_free_stats:
+    free_percpu(priv_dev->stats);
+err_free:
+    kfree(priv_dev);
+    return NULL;
+}
+
+// 释放缓冲池；导出的dma-buf还在时由最后一个引用放下时释放
+static void mydma_pool_free(struct mydma_dev *priv_dev)
+{
+    if (!priv_dev->pool_virt_addr) return;
+    dma_free_coherent(priv_dev->dev, priv_dev->pool_size, priv_dev->pool_virt_addr, priv_dev->pool_dma_addr);
+    priv_dev->pool_virt_addr = NULL;
+}
+
+static void mydma_dev_release(struct kref *ref)
+{
+    struct mydma_dev *priv_dev = container_of(ref, struct mydma_dev, ref);
+    u32 i;
+
+    mydma_pool_free(priv_dev);
+    for (i = 0; priv_dev->queues && i < priv_dev->nr_queues; i++)
+        kfree(priv_dev->queues[i].pool_bitmap);
+    kfree(priv_dev->queues);
+    kfree(priv_dev->cpu_queue);
+    kfree(priv_dev->pool_bufs);
+    cleanup_srcu_struct(&priv_dev->srcu);
+    free_percpu(priv_dev->stats);
+    put_device(priv_dev->dev);
+    kfree(priv_dev);
+}
+
+static void mydma_dev_put(struct mydma_dev *priv_dev)
+{
+    kref_put(&priv_dev->ref, mydma_dev_release);
+}
+
+// 复位设备并读出能力位，返回可用的最大队列数：不超过设备支持的个数、在线CPU数加hiprio_queues、
+// 长度为regs_len的寄存器窗口能容纳的寄存器组数以及max_queues参数
+static u32 mydma_hw_reset(struct mydma_dev *priv_dev, resource_size_t regs_len)
+{
+    u32 nr;
+
+    mydma_reset_device(priv_dev);
+    priv_dev->caps = readl(priv_dev->bar0_virt_addr + MYDMA_REG_DEV_CAPS);
+
+    nr = max_t(u32, readl(priv_dev->bar0_virt_addr + MYDMA_REG_NUM_QUEUES), 1);
+    nr = min_t(u32, nr, num_online_cpus() + hiprio_queues);
+    nr = min_t(u32, nr, regs_len / MYDMA_QUEUE_REG_STRIDE);
+    if (max_queues) nr = min(nr, max_queues);
+    return max_t(u32, nr, 1);
+}
+
+// nr个队列中保留给高优先级文件的个数，至少留一个普通队列
+static u32 mydma_nr_hiprio(u32 nr)
+{
+    return nr > 1 ? min(hiprio_queues, nr - 1) : 0;
+}
+
+// 队列qid的中断号：PCI设备为对应的MSI-X/MSI向量，模拟设备为irq_sim中断
+static int mydma_queue_irq(struct mydma_dev *priv_dev, u32 qid)
+{
+    if (priv_dev->mock) return mydma_mock_irq(priv_dev->mock, qid);
+    return pci_irq_vector(priv_dev->pdev, qid);
+}
+
+// 与后端无关的初始化：分配环形缓冲区和缓冲池、申请中断并创建字符设备。
+// 调用者已映射寄存器、设置好DMA掩码，并按中断向量的个数确定了nr_queues；设备已启用运行时电源管理，
+// 调用者持有一个使用计数，成功时此处放下它
+static int mydma_dev_setup(struct mydma_dev *priv_dev)
+{
+    struct device *dev = priv_dev->dev;
+    u32 i, per_queue, nr_irqs = 0;
+    struct mydma_queue *q;
+    int ret;
+
+    priv_dev->ring_size = roundup_pow_of_two(clamp_t(u32, ring_size, MYDMA_RING_MIN_SIZE, MYDMA_RING_MAX_SIZE));
+    priv_dev->queues = kcalloc(priv_dev->nr_queues, sizeof(struct mydma_queue), GFP_KERNEL);
+    priv_dev->cpu_queue = kcalloc(nr_cpu_ids, sizeof(u32), GFP_KERNEL);
+    if (!priv_dev->queues || !priv_dev->cpu_queue) return -ENOMEM;
+    mydma_setup_desc_format(priv_dev);
+
+    // 一次性分配整个缓冲池并按队列均分，记录每个缓冲区在池内的固定位置
+    per_queue = pool_bufs ? pool_bufs / priv_dev->nr_queues : priv_dev->ring_size;
+    per_queue = max_t(u32, per_queue, 1);
+    priv_dev->pool_nr_bufs = per_queue * priv_dev->nr_queues;
+    priv_dev->pool_bufs = kcalloc(priv_dev->pool_nr_bufs, sizeof(struct mydma_buf), GFP_KERNEL);
+    if (!priv_dev->pool_bufs) return -ENOMEM;
+
+    priv_dev->pool_size = priv_dev->pool_nr_bufs * MYDMA_POOL_BUF_SIZE;
+    priv_dev->pool_virt_addr = dma_alloc_coherent(dev, priv_dev->pool_size, &priv_dev->pool_dma_addr, GFP_KERNEL);
+    if (!priv_dev->pool_virt_addr) { dev_err(dev, "buffer pool alloc failed\n"); return -ENOMEM; }
+    for (i = 0; i < priv_dev->pool_nr_bufs; i++) {
+        priv_dev->pool_bufs[i].dma_addr = priv_dev->pool_dma_addr + i * MYDMA_POOL_BUF_SIZE;
+        priv_dev->pool_bufs[i].virt_addr = priv_dev->pool_virt_addr + i * MYDMA_POOL_BUF_SIZE;
+    }
+    pr_info("mydma: Allocated buffer pool, %u x %lu bytes\n", priv_dev->pool_nr_bufs, MYDMA_POOL_BUF_SIZE);
+
+    for (i = 0; i < priv_dev->nr_queues; i++) {
+        ret = mydma_queue_init(priv_dev, i, per_queue);
+        if (ret) goto err_free_rings;
+    }
+    mydma_update_max_transfer(priv_dev);
+    mydma_map_cpus(priv_dev);
+
+    for (nr_irqs = 0; nr_irqs < priv_dev->nr_queues; nr_irqs++) {
+        q = &priv_dev->queues[nr_irqs];
+        q->irq = mydma_queue_irq(priv_dev, nr_irqs);
+        ret = q->irq < 0 ? q->irq :
+              request_threaded_irq(q->irq, mydma_irq_handler, mydma_irq_thread, IRQF_ONESHOT, DRIVER_NAME, q);
+        if (ret) { dev_err(dev, "request_threaded_irq failed for queue %u\n", nr_irqs); goto err_free_irq; }
+    }
+    pr_info("mydma: Requested %u IRQs for %u queues\n", nr_irqs, priv_dev->nr_queues);
+
+    if (priv_dev->caps & MYDMA_CAP_INT_COAL) {
+        writel(coal_count, priv_dev->bar0_virt_addr + MYDMA_REG_INT_COAL_COUNT);
+        writel(coal_usecs, priv_dev->bar0_virt_addr + MYDMA_REG_INT_COAL_USECS);
+        pr_info("mydma: Interrupt coalescing: %u completions / %u us\n", coal_count, coal_usecs);
+    } else {
+        dev_info(dev, "no hardware interrupt coalescing, using budgeted polling in IRQ thread\n");
+    }
+
+    for (i = 0; i < priv_dev->nr_queues; i++)
+        writel(1, priv_dev->queues[i].regs + MYDMA_REG_INT_ENABLE);
+    pr_info("mydma: Hardware interrupts enabled\n");
+
+    ret = mydma_chrdev_setup(priv_dev);
+    if (ret) { goto err_free_irq; }
+
+    if (watchdog_ms) schedule_delayed_work(&priv_dev->watchdog, msecs_to_jiffies(watchdog_ms));
+
+    // 放下probe期间的使用计数，此后由提交路径按队列持有
+    pm_runtime_set_autosuspend_delay(dev, autosuspend_ms);
+    pm_runtime_use_autosuspend(dev);
+    pm_runtime_mark_last_busy(dev);
+    pm_runtime_put_autosuspend(dev);
+    return 0;
+
+err_free_irq:
+    for (i = 0; i < nr_irqs; i++) {
+        q = &priv_dev->queues[i];
+        writel(0, q->regs + MYDMA_REG_INT_ENABLE);
+        free_irq(q->irq, q);
+    }
+err_free_rings:
+    mydma_queues_free(priv_dev);
+    mydma_pool_free(priv_dev);
+    return ret;
+}
+
+// 缓冲池中是否还有导出为dma-buf的缓冲区
+static bool mydma_pool_exported(struct mydma_dev *priv_dev)
+{
+    struct mydma_queue *q;
+    bool exported = false;
+    u32 i, j;
+
+    for (i = 0; i < priv_dev->nr_queues && !exported; i++) {
+        q = &priv_dev->queues[i];
+        spin_lock(&q->ring_lock);
+        for (j = q->buf_base; j < q->buf_base + q->nr_bufs && !exported; j++)
+            exported = priv_dev->pool_bufs[j].exports != 0;
+        spin_unlock(&q->ring_lock);
+    }
+    return exported;
+}
+
+// mydma_dev_setup()的逆过程，调用者已唤醒设备并重新持有使用计数。先排空再复位，设备停止DMA之后才释放内存。
+// 仍打开的文件只剩release()可用，它们持有的引用让priv_dev保留到最后一个文件关闭。
+// 之后由调用者调用mydma_dev_gc()和mydma_dev_put()
+static void mydma_dev_teardown(struct mydma_dev *priv_dev)
+{
+    struct mydma_file *mfile;
+    struct mydma_queue *q;
+    bool drained;
+    u32 i;
+
+    cancel_delayed_work_sync(&priv_dev->watchdog);
+    mydma_chrdev_cleanup(priv_dev);
+
+    drained = mydma_drain(priv_dev);
+
+    // dying已经设置：唤醒各文件上等待完成的调用者，等正在执行的文件操作全部退出，之后的都返回-ENODEV。
+    // 排空超时的时候，仍在填描述符的提交者退出前还会敲门铃，要等它们都退出之后才能复位设备。
+    // 这时也不会再有新的mmap()，撤销已有的缓冲池映射，用户再访问时收到SIGBUS
+    mutex_lock(&priv_dev->cfg_lock);
+    list_for_each_entry(mfile, &priv_dev->files, node)
+        wake_up(&mfile->wait);
+    mutex_unlock(&priv_dev->cfg_lock);
+    synchronize_srcu(&priv_dev->srcu);
+    mutex_lock(&priv_dev->cfg_lock);
+    list_for_each_entry(mfile, &priv_dev->files, node)
+        unmap_mapping_range(mfile->filp->f_mapping, 0, 0, 1);
+    mutex_unlock(&priv_dev->cfg_lock);
+
+    if (remove_reset || !drained) mydma_reset_device(priv_dev);
+    mydma_wake_all(priv_dev);
+
+    // 不再有提交者，各队列不再获取设备引用
+    for (i = 0; i < priv_dev->nr_queues; i++) {
+        q = &priv_dev->queues[i];
+        cancel_delayed_work_sync(&q->pm_idle);
+        if (q->pm_held) pm_runtime_put_noidle(priv_dev->dev);
+        q->pm_held = false;
+    }
+    pm_runtime_dont_use_autosuspend(priv_dev->dev);
+
+    for (i = 0; i < priv_dev->nr_queues; i++) {
+        q = &priv_dev->queues[i];
+        writel(0, q->regs + MYDMA_REG_INT_ENABLE);
+        free_irq(q->irq, q);
+    }
+
+    // 不会再有完成事件，仍打开的文件关闭时不必再摘除它们在环形缓冲区和缓冲池中的引用
+    mutex_lock(&priv_dev->cfg_lock);
+    priv_dev->torn_down = true;
+    mutex_unlock(&priv_dev->cfg_lock);
+
+    // 导入方设备可能还映射着导出的缓冲区，这时缓冲池留到最后一个dma-buf释放
+    if (mydma_pool_exported(priv_dev))
+        dev_warn(priv_dev->dev, "buffer pool still exported as dma-buf, freeing it with the last reference\n");
+    else
+        mydma_pool_free(priv_dev);
+
+    mydma_queues_free(priv_dev);
+}
+
+// 设备已停止DMA，可以释放所有放弃等待的直接模式传输
+static void mydma_dev_gc(struct mydma_dev *priv_dev)
+{
+    u32 i;
+
+    for (i = 0; i < priv_dev->nr_queues; i++)
+        mydma_direct_gc(&priv_dev->queues[i], true);
+}
+
+static int mydma_probe(struct pci_dev *pdev, const struct pci_device_id *id)
+{
+    int ret;
+    u32 nr;
+    struct mydma_dev *priv_dev;
+    struct irq_affinity affd = { 0 };
+
+    priv_dev = mydma_dev_alloc(&pdev->dev);
+    if (!priv_dev) { return -ENOMEM; }
+    pci_set_drvdata(pdev, priv_dev);
+    priv_dev->pdev = pdev;
+
+    ret = pci_enable_device(pdev);
+    if (ret) { dev_err(&pdev->dev, "pci_enable_device failed\n"); goto err_put; }
+
+    ret = pci_request_regions(pdev, DRIVER_NAME);
+    if (ret) { dev_err(&pdev->dev, "pci_request_regions failed\n"); goto err_disable_device; }
+    pci_set_master(pdev);
+
+    priv_dev->bar0_virt_addr = pci_iomap(pdev, 0, 0);
+    if (!priv_dev->bar0_virt_addr) { ret = -EIO; dev_err(&pdev->dev, "pci_iomap failed\n"); goto err_release_regions; }
+
+    nr = mydma_hw_reset(priv_dev, pci_resource_len(pdev, 0));
+
+    ret = dma_set_mask_and_coherent(&pdev->dev, DMA_BIT_MASK(64));
+    if (ret) { ret = dma_set_mask_and_coherent(&pdev->dev, DMA_BIT_MASK(32)); }
+    if (ret) { dev_err(&pdev->dev, "DMA configuration failed\n"); goto err_iounmap; }
+
+    // 每个队列一个MSI-X向量，由中断核心把向量分布到各CPU并设定亲和性；高优先级队列的向量放在末尾，不参与分布。
+    // 向量不够时先放弃高优先级队列，不支持MSI-X时退回单个MSI向量、单队列
+    affd.post_vectors = mydma_nr_hiprio(nr);
+    ret = -ENOSPC;
+    if (affd.post_vectors)
+        ret = pci_alloc_irq_vectors_affinity(pdev, affd.post_vectors + 1, nr, PCI_IRQ_MSIX | PCI_IRQ_AFFINITY, &affd);
+    if (ret < 0) { affd.post_vectors = 0; ret = pci_alloc_irq_vectors(pdev, 1, nr, PCI_IRQ_MSIX | PCI_IRQ_AFFINITY); }
+    if (ret < 0) ret = pci_alloc_irq_vectors(pdev, 1, 1, PCI_IRQ_MSI);
+    if (ret < 0) { dev_err(&pdev->dev, "pci_alloc_irq_vectors failed\n"); goto err_iounmap; }
+    priv_dev->nr_queues = ret;
+    priv_dev->nr_hiprio = affd.post_vectors;
+
+    // PCI核心在probe期间持有一个使用计数，由mydma_dev_setup()放下；默认允许运行时挂起
+    ret = mydma_dev_setup(priv_dev);
+    if (ret) goto err_free_irq_vectors;
+    pm_runtime_allow(&pdev->dev);
+    pci_save_state(pdev); // 供错误恢复和功能级复位之后恢复
+
+    pr_info("mydma: probe successful\n");
+    return 0;
+
+err_free_irq_vectors:
+    pci_free_irq_vectors(pdev);
+err_iounmap:
+    if (priv_dev->wc_base) pci_iounmap(pdev, priv_dev->wc_base);
+    pci_iounmap(pdev, priv_dev->bar0_virt_addr);
+err_release_regions:
+    pci_release_regions(pdev);
+err_disable_device:
+    pci_disable_device(pdev);
+err_put:
+    pci_set_drvdata(pdev, NULL);
+    mydma_dev_put(priv_dev);
+    return ret;
+}
+
+static void mydma_remove(struct pci_dev *pdev)
+{
+    struct mydma_dev *priv_dev = pci_get_drvdata(pdev);
+    if (!priv_dev) return;
+
+    pr_info("mydma: remove function called\n");
+
+    // PCI核心已在调用remove前唤醒设备，这里取回probe时放下的使用计数
+    pm_runtime_forbid(&pdev->dev);
+    pm_runtime_get_noresume(&pdev->dev);
+    mydma_dev_teardown(priv_dev);
+    pci_free_irq_vectors(pdev);
+
+    if (priv_dev->wc_base) {
+        pci_iounmap(pdev, priv_dev->wc_base);
+    }
+    if (priv_dev->bar0_virt_addr) {
+        pci_iounmap(pdev, priv_dev->bar0_virt_addr);
+    }
+
+    pci_release_regions(pdev);
+    pci_disable_device(pdev);
+
+    mydma_dev_gc(priv_dev);
+    pci_set_drvdata(pdev, NULL);
+    mydma_dev_put(priv_dev);
+    pr_info("mydma: device removed successfully\n");
+}
+
+// --- 模拟后端 ---
+// 没有硬件时，用mock_devs=N创建N个模拟设备，在CI和开发机上剖析、测试提交/完成路径。
+// 寄存器是一块普通内存，驱动照常用readl/writel访问；一个内核线程扮演设备：按尾指针取描述符，
+// 按mock_latency_ns和mock_mbps算出完成时刻，到期后搬运数据、回写done标志或status、推进QUEUE_HEAD，
+// 再经irq_sim产生中断。除了门铃和设置环形缓冲区地址两处需要通知设备模型(真实设备由MMIO写直接触发)，
+// 驱动走的代码路径与真实设备完全相同。
+// 设备模型以phys_to_virt(dma_to_phys())访问描述符和数据，只适用于没有IOMMU、DMA一致的平台(如x86)
+#if IS_ENABLED(CONFIG_IRQ_SIM)
+
+static struct platform_device *mydma_mock_pdevs[MYDMA_MAX_DEVICES];
+static u32 mydma_mock_nr_pdevs;
+
+// 模拟设备看到的DMA地址对应的内核虚拟地址，不在内存中(例如P2P的BAR地址)时返回NULL
+static void *mydma_mock_virt(struct mydma_mock *m, dma_addr_t addr)
+{
+    phys_addr_t phys = dma_to_phys(m->dev, addr);
+
+    if (!pfn_valid(PHYS_PFN(phys))) return NULL;
+    return phys_to_virt(phys);
+}
+
+// 取出一个描述符时算出它的完成时刻：数据按mock_mbps依次占用所有队列共用的链路，再加上固定的延迟。
+// 严格优先的队列插到链路上所有已排定的传输之前，只与其他严格优先的传输排队，之后取出的普通描述符顺延；
+// 已排定的完成时刻不再推迟，短时间内的总带宽会略高于mock_mbps。加权轮询的权重不模拟
+static u64 mydma_mock_due(struct mydma_mock *m, u64 now, u32 len, bool strict)
+{
+    u32 mbps = READ_ONCE(mock_mbps);
+    u64 xfer = mbps ? div_u64((u64)len * 1000, mbps) : 0;
+    u64 start;
+
+    if (strict) {
+        start = max(now, m->prio_free_ns) + xfer;
+        m->prio_free_ns = start;
+        m->link_free_ns = max(now, m->link_free_ns) + xfer;
+    } else {
+        start = max(now, m->link_free_ns) + xfer;
+        m->link_free_ns = start;
+    }
+    return start + READ_ONCE(mock_latency_ns);
+}
+
+static u32 mydma_mock_desc_len(void *desc, bool desc64)
+{
+    if (desc64) return ((struct mydma_desc64 *)desc)->in_len;
+    return ((struct dma_descriptor *)desc)->in_len;
+}
+
+// 执行并完成一个描述符：就地操作和内联描述符不需要搬运数据；数据写完之后才回写完成标志
+static void mydma_mock_complete(struct mydma_mock *m, void *desc, bool desc64)
+{
+    struct mydma_desc64 *d64 = desc;
+    struct dma_descriptor *d = desc;
+    dma_addr_t in = desc64 ? d64->in_addr : d->in_addr;
+    dma_addr_t out = desc64 ? d64->out_addr : d->out_addr;
+    void *src, *dst;
+
+    if (in != out && !(desc64 && (d64->flags & MYDMA_DESC_F_INLINE))) {
+        src = mydma_mock_virt(m, in);
+        dst = mydma_mock_virt(m, out);
+        if (src && dst) memmove(dst, src, mydma_mock_desc_len(desc, desc64));
+    }
+    if (desc64 && (d64->flags & MYDMA_DESC_F_CRC)) {
+        dst = mydma_mock_virt(m, out);
+        WRITE_ONCE(d64->crc, dst ? crc32c(~0U, dst, d64->out_len) : 0);
+    }
+
+    smp_wmb();
+    if (desc64)
+        WRITE_ONCE(d64->status, MYDMA_DESC_ST_DONE | ((d64->flags & MYDMA_DESC_F_PHASE) ? MYDMA_DESC_ST_PHASE : 0));
+    else
+        WRITE_ONCE(d->done, 0);
+}
+
+// 推进一个队列：取出新提交的描述符，完成已到期的描述符。返回该队列下一次需要处理的时刻，空闲时为U64_MAX
+static u64 mydma_mock_run_queue(struct mydma_mock *m, u32 qid, u64 now)
+{
+    struct mydma_mock_queue *mq = &m->q[qid];
+    void __iomem *regs = m->regs + qid * MYDMA_QUEUE_REG_STRIDE;
+    bool desc64 = readl(m->regs + MYDMA_REG_DESC_FORMAT) & MYDMA_DESC_FMT_64;
+    size_t desc_size = desc64 ? sizeof(struct mydma_desc64) : sizeof(struct dma_descriptor);
+    u32 size, mask, tail, done = 0;
+    u64 next = U64_MAX;
+    dma_addr_t ring;
+    bool strict;
+    void *base;
+
+    spin_lock(&m->lock);
+    ring = ((u64)readl(regs + MYDMA_REG_RING_ADDR_HI) << 32) | readl(regs + MYDMA_REG_RING_ADDR_LO);
+    size = readl(regs + MYDMA_REG_RING_SIZE);
+    base = ring ? mydma_mock_virt(m, ring) : NULL;
+    if (!base || !is_power_of_2(size)) goto out;
+    mask = size - 1;
+    strict = readl(regs + MYDMA_REG_QUEUE_ARB) & MYDMA_ARB_STRICT;
+
+    // 像真实设备的预取队列一样，最多提前取MYDMA_MOCK_WINDOW个描述符
+    tail = readl(regs + MYDMA_REG_QUEUE_TAIL) & mask;
+    while (mq->fetch != tail && mq->nr < MYDMA_MOCK_WINDOW) {
+        mq->due_ns[mq->fetch & (MYDMA_MOCK_WINDOW - 1)] =
+            mydma_mock_due(m, now, mydma_mock_desc_len(base + mq->fetch * desc_size, desc64), strict);
+        mq->fetch = (mq->fetch + 1) & mask;
+        mq->nr++;
+    }
+
+    // 延迟对所有描述符相同，完成顺序与提交顺序一致
+    while (mq->nr && mq->due_ns[mq->head & (MYDMA_MOCK_WINDOW - 1)] <= now) {
+        mydma_mock_complete(m, base + mq->head * desc_size, desc64);
+        mq->head = (mq->head + 1) & mask;
+        mq->nr--;
+        done++;
+    }
+    if (done) writel(mq->head, regs + MYDMA_REG_QUEUE_HEAD);
+
+    if (mq->nr) next = mq->due_ns[mq->head & (MYDMA_MOCK_WINDOW - 1)];
+    else if (mq->fetch != tail) next = now;
+out:
+    spin_unlock(&m->lock);
+
+    // 与真实设备一样，INT_ENABLE为0时不产生中断，由轮询者自己回收
+    if (done && readl(regs + MYDMA_REG_INT_ENABLE))
+        irq_set_irqchip_state(irq_find_mapping(m->irq_domain, qid), IRQCHIP_STATE_PENDING, true);
+    return next;
+}
+
+// 设备模型线程：没有在途描述符时睡眠到下一次门铃；下一个完成时刻很近时忙等，否则睡到快到期时
+static int mydma_mock_thread(void *data)
+{
+    struct mydma_mock *m = data;
+    u64 now, next;
+    u32 i;
+
+    while (!kthread_should_stop()) {
+        // 先清除kicked再扫描，扫描期间的门铃会重新置位，不会丢失
+        WRITE_ONCE(m->kicked, false);
+        smp_mb();
+
+        now = ktime_get_ns();
+        next = U64_MAX;
+        for (i = 0; i < m->nr_queues; i++)
+            next = min(next, mydma_mock_run_queue(m, i, now));
+
+        if (next == U64_MAX)
+            wait_event_interruptible(m->wait, READ_ONCE(m->kicked) || kthread_should_stop());
+        else if (next > now + MYDMA_MOCK_SPIN_NS)
+            wait_event_interruptible_hrtimeout(m->wait, READ_ONCE(m->kicked) || kthread_should_stop(),
+                                               ns_to_ktime(next - now - MYDMA_MOCK_SPIN_NS));
+        else
+            cond_resched();
+    }
+    return 0;
+}
+
+// 门铃：真实设备由写QUEUE_TAIL触发取描述符，模拟设备需要叫醒设备模型
+static void mydma_mock_kick(struct mydma_mock *m)
+{
+    WRITE_ONCE(m->kicked, true);
+    if (wq_has_sleeper(&m->wait)) wake_up(&m->wait);
+}
+
+// 真实设备在写RING_ADDR_LO时复位该队列的头尾指针，模拟设备在这里同步完成
+static void mydma_mock_ring_reset(struct mydma_mock *m, u32 qid)
+{
+    void __iomem *regs = m->regs + qid * MYDMA_QUEUE_REG_STRIDE;
+
+    spin_lock(&m->lock);
+    m->q[qid].fetch = 0;
+    m->q[qid].head = 0;
+    m->q[qid].nr = 0;
+    writel(0, regs + MYDMA_REG_QUEUE_HEAD);
+    writel(0, regs + MYDMA_REG_QUEUE_TAIL);
+    spin_unlock(&m->lock);
+}
+
+// 写DEV_RESET：所有队列停止工作，环形缓冲区寄存器、头尾指针和中断使能清零，仲裁恢复为权重1，描述符格式恢复为32字节
+static void mydma_mock_reset(struct mydma_mock *m)
+{
+    void __iomem *regs;
+    u32 i;
+
+    spin_lock(&m->lock);
+    for (i = 0; i < m->nr_queues; i++) {
+        regs = m->regs + i * MYDMA_QUEUE_REG_STRIDE;
+        memset(&m->q[i], 0, sizeof(m->q[i]));
+        writel(0, regs + MYDMA_REG_RING_ADDR_LO);
+        writel(0, regs + MYDMA_REG_RING_ADDR_HI);
+        writel(0, regs + MYDMA_REG_QUEUE_HEAD);
+        writel(0, regs + MYDMA_REG_QUEUE_TAIL);
+        writel(0, regs + MYDMA_REG_INT_ENABLE);
+        writel(1, regs + MYDMA_REG_QUEUE_ARB);
+    }
+    writel(0, m->regs + MYDMA_REG_DESC_FORMAT);
+    m->link_free_ns = 0;
+    m->prio_free_ns = 0;
+    spin_unlock(&m->lock);
+}
+
+static int mydma_mock_irq(struct mydma_mock *m, u32 qid)
+{
+    return irq_find_mapping(m->irq_domain, qid);
+}
+
+static void mydma_mock_free_irqs(struct mydma_mock *m)
+{
+    u32 i;
+
+    for (i = 0; i < m->nr_queues; i++)
+        irq_dispose_mapping(irq_find_mapping(m->irq_domain, i));
+    irq_domain_remove_sim(m->irq_domain);
+    irq_domain_free_fwnode(m->fwnode);
+}
+
+// 创建模拟设备：寄存器窗口、每个队列一个irq_sim中断，并启动设备模型线程
+static struct mydma_mock *mydma_mock_create(struct device *dev)
 {
+    u32 i, nr = num_online_cpus() + hiprio_queues;
+    struct mydma_mock *m;
+    int ret;
+
+    m = devm_kzalloc(dev, struct_size(m, q, nr), GFP_KERNEL);
+    if (!m) return ERR_PTR(-ENOMEM);
+    m->dev = dev;
+    m->nr_queues = nr;
+    m->regs_len = nr * MYDMA_QUEUE_REG_STRIDE;
+    m->regs = (void __force __iomem *)devm_kzalloc(dev, m->regs_len, GFP_KERNEL);
+    if (!m->regs) return ERR_PTR(-ENOMEM);
+    spin_lock_init(&m->lock);
+    init_waitqueue_head(&m->wait);
+
+    // 只读寄存器；中断合并和写合并窗口不模拟，WC_QUEUE_STRIDE保持为0
+    writel(mock_caps & (MYDMA_CAP_DESC64 | MYDMA_CAP_INLINE | MYDMA_CAP_QUEUE_ARB | MYDMA_CAP_CRC32C),
+           m->regs + MYDMA_REG_DEV_CAPS);
+    writel(nr, m->regs + MYDMA_REG_NUM_QUEUES);
+
+    m->fwnode = irq_domain_alloc_named_fwnode(dev_name(dev));
+    if (!m->fwnode) return ERR_PTR(-ENOMEM);
+    m->irq_domain = irq_domain_create_sim(m->fwnode, nr);
+    if (IS_ERR(m->irq_domain)) {
+        irq_domain_free_fwnode(m->fwnode);
+        return ERR_CAST(m->irq_domain);
+    }
+    for (i = 0; i < nr; i++) {
+        if (!irq_create_mapping(m->irq_domain, i)) { ret = -ENOMEM; goto err_free_irqs; }
+    }
+
+    m->thread = kthread_run(mydma_mock_thread, m, "%s", dev_name(dev));
+    if (IS_ERR(m->thread)) { ret = PTR_ERR(m->thread); goto err_free_irqs; }
+    return m;
+
+err_free_irqs:
+    mydma_mock_free_irqs(m);
+    return ERR_PTR(ret);
+}
+
+static int mydma_mock_probe(struct platform_device *pdev)
+{
+    struct mydma_dev *priv_dev;
+    struct mydma_mock *m;
+    int ret;
+
+    priv_dev = mydma_dev_alloc(&pdev->dev);
+    if (!priv_dev) { return -ENOMEM; }
+    platform_set_drvdata(pdev, priv_dev);
+
+    m = mydma_mock_create(&pdev->dev);
+    if (IS_ERR(m)) { ret = PTR_ERR(m); goto err_free; }
+    priv_dev->mock = m;
+    priv_dev->bar0_virt_addr = m->regs;
+    priv_dev->nr_queues = mydma_hw_reset(priv_dev, m->regs_len);
+    priv_dev->nr_hiprio = mydma_nr_hiprio(priv_dev->nr_queues);
+
+    ret = dma_coerce_mask_and_coherent(&pdev->dev, DMA_BIT_MASK(64));
+    if (ret) { dev_err(&pdev->dev, "DMA configuration failed\n"); goto err_destroy; }
+
+    // 平台设备默认不启用运行时电源管理，仿照PCI核心持有一个使用计数交给mydma_dev_setup()
+    pm_runtime_set_active(&pdev->dev);
+    pm_runtime_get_noresume(&pdev->dev);
+    ret = devm_pm_runtime_enable(&pdev->dev);
+    if (ret) goto err_put;
+
+    ret = mydma_dev_setup(priv_dev);
+    if (ret) goto err_put;
+
+    dev_info(&pdev->dev, "emulated device: %u queues, %u ns latency, %u MB/s\n",
+             priv_dev->nr_queues, mock_latency_ns, mock_mbps);
+    return 0;
+
+err_put:
+    pm_runtime_put_noidle(&pdev->dev);
+err_destroy:
+    kthread_stop(m->thread);
+    mydma_mock_free_irqs(m);
+err_free:
+    mydma_dev_put(priv_dev);
+    return ret;
+}
+
+static int mydma_mock_remove(struct platform_device *pdev)
+{
+    struct mydma_dev *priv_dev = platform_get_drvdata(pdev);
+    struct mydma_mock *m = priv_dev->mock;
+
+    // 排空期间设备模型还要继续运行；teardown复位设备之后它不再访问环形缓冲区
+    pm_runtime_get_sync(&pdev->dev);
+    mydma_dev_teardown(priv_dev);
+    kthread_stop(m->thread);
+    mydma_mock_free_irqs(m);
+    mydma_dev_gc(priv_dev);
+    pm_runtime_put_noidle(&pdev->dev);
+    mydma_dev_put(priv_dev);
+    return 0;
+}
+
+static struct platform_driver mydma_mock_driver = {
+    .driver = { .name = DRIVER_NAME "_mock", .pm = &mydma_pm_ops, .probe_type = PROBE_PREFER_ASYNCHRONOUS },
+    .probe  = mydma_mock_probe,
+    .remove = mydma_mock_remove,
+};
+
+static void mydma_mock_exit(void)
+{
+    while (mydma_mock_nr_pdevs)
+        platform_device_unregister(mydma_mock_pdevs[--mydma_mock_nr_pdevs]);
+    if (mock_devs) platform_driver_unregister(&mydma_mock_driver);
+}
+
+// 注册模拟设备的平台驱动并创建mock_devs个设备，它们与PCI设备共用次设备号，依次出现为/dev/mydmaN
+static int mydma_mock_init(void)
+{
+    struct platform_device *pdev;
+    int ret;
+
+    if (!mock_devs) return 0;
+    ret = platform_driver_register(&mydma_mock_driver);
+    if (ret) return ret;
+
+    while (mydma_mock_nr_pdevs < min_t(u32, mock_devs, MYDMA_MAX_DEVICES)) {
+        pdev = platform_device_register_simple(DRIVER_NAME "_mock", mydma_mock_nr_pdevs, NULL, 0);
+        if (IS_ERR(pdev)) {
+            mydma_mock_exit();
+            return PTR_ERR(pdev);
+        }
+        mydma_mock_pdevs[mydma_mock_nr_pdevs++] = pdev;
+    }
+    return 0;
+}
+
+#else /* !CONFIG_IRQ_SIM */
+
+static int mydma_mock_init(void)
+{
+    if (!mock_devs) return 0;
+    pr_err("mydma: mock_devs needs a kernel built with CONFIG_IRQ_SIM\n");
+    return -EOPNOTSUPP;
+}
+
+static void mydma_mock_exit(void) { }
+static void mydma_mock_kick(struct mydma_mock *m) { }
+static void mydma_mock_ring_reset(struct mydma_mock *m, u32 qid) { }
+static void mydma_mock_reset(struct mydma_mock *m) { }
+static int mydma_mock_irq(struct mydma_mock *m, u32 qid) { return -ENODEV; }
+
+#endif /* CONFIG_IRQ_SIM */
+
+
+// --- 6. Module Init/Exit ---
+// 字符设备号区间和设备类在模块加载时创建一次，由所有设备共用
+static int __init mydma_init(void)
+{
+    int ret;
+
     pr_info("mydma: driver loading\n");
-    return pci_register_driver(&mydma_driver);
+
+    ret = alloc_chrdev_region(&mydma_devt, 0, MYDMA_MAX_DEVICES, DEVICE_NAME);
+    if (ret) { pr_err("mydma: Failed to allocate chrdev region\n"); return ret; }
+
+    mydma_class = class_create(THIS_MODULE, DEVICE_NAME);
+    if (IS_ERR(mydma_class)) {
+        ret = PTR_ERR(mydma_class);
+        pr_err("mydma: Failed to create device class\n");
+        goto err_unregister_chrdev;
+    }
+
+    ret = pci_register_driver(&mydma_driver);
+    if (ret) goto err_class_destroy;
+
+    ret = mydma_mock_init();
+    if (ret) goto err_unregister_driver;
+    return 0;
+
+err_unregister_driver: pci_unregister_driver(&mydma_driver);
+err_class_destroy: class_destroy(mydma_class);
+err_unregister_chrdev: unregister_chrdev_region(mydma_devt, MYDMA_MAX_DEVICES);
+    return ret;
 }
 
 static void __exit mydma_exit(void)
 {
     pr_info("mydma: driver unloading\n");
+    mydma_mock_exit();
     pci_unregister_driver(&mydma_driver);
+    class_destroy(mydma_class);
+    unregister_chrdev_region(mydma_devt, MYDMA_MAX_DEVICES);
+    idr_destroy(&mydma_minor_idr);
 }
 
 module_init(mydma_init);
@@ -454,5 +4670,6 @@ module_exit(mydma_exit);
 
 // --- 7. Module Metadata ---
 MODULE_LICENSE("GPL");
+MODULE_IMPORT_NS(DMA_BUF);
 MODULE_AUTHOR("mr.linux@foxmail.com");
 MODULE_DESCRIPTION("Final PCIe DMA loopback driver with in-place DMA and MSI interrupts.");
@@ -0,0 +1,177 @@
+/*
+ * mydma_ioctl.h - mydma驱动与用户空间共享的ioctl接口定义
+ * 内核模块和用户态程序(test_dma.c等)都包含此头文件。
+ */
+
+#ifndef MYDMA_IOCTL_H
+#define MYDMA_IOCTL_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define MYDMA_IOC_MAGIC 'M'
+
+// --- 零拷贝缓冲池 ---
+// 在/dev/mydmaN上以偏移 N * buf_size 调用mmap()映射本文件BUF_ALLOC得到的缓冲区N，一次可以映射多个相邻的缓冲区；
+// 范围内有不属于本文件的缓冲区时返回EACCES。BUF_FREE撤销该缓冲区的映射，之后再访问收到SIGBUS。
+// 使用流程：BUF_ALLOC申请缓冲区 -> mmap()映射 -> 在映射中填写数据 -> SUBMIT提交 -> COMPLETE等待完成并读取结果 -> BUF_FREE归还。
+
+// 缓冲池布局信息
+struct mydma_pool_info {
+    __u32 nr_bufs;  // 缓冲区个数
+    __u32 buf_size; // 每个缓冲区的字节数
+};
+
+// 针对缓冲池中某个缓冲区的请求
+struct mydma_buf_req {
+    __u32 buf;      // 缓冲区编号
+    __u32 len;      // SUBMIT: 待传输的字节数; COMPLETE: 返回完成的字节数
+};
+
+#define MYDMA_IOC_POOL_INFO _IOR(MYDMA_IOC_MAGIC, 0x00, struct mydma_pool_info)
+#define MYDMA_IOC_BUF_ALLOC _IOR(MYDMA_IOC_MAGIC, 0x01, __u32)
+#define MYDMA_IOC_BUF_FREE  _IOW(MYDMA_IOC_MAGIC, 0x02, __u32)
+#define MYDMA_IOC_SUBMIT    _IOW(MYDMA_IOC_MAGIC, 0x03, struct mydma_buf_req)
+#define MYDMA_IOC_COMPLETE  _IOWR(MYDMA_IOC_MAGIC, 0x04, struct mydma_buf_req)
+
+// --- 共享内存提交/完成队列 (类似io_uring) ---
+// URING_SETUP之后，以MYDMA_MMAP_OFF_URING为偏移mmap() region_size字节即可访问SQ/CQ。
+// 用户在SQ中填写SQE并推进sq_tail，再调用一次URING_ENTER("门铃")批量提交；
+// 完成事件由中断路径直接写入CQ，用户推进cq_head消费，无需每个操作一次系统调用。
+// SQE中的缓冲区必须已通过BUF_ALLOC申请；CQE送达后缓冲区重新归用户所有。
+#define MYDMA_MMAP_OFF_URING 0x10000000ULL
+
+// 提交队列项
+struct mydma_sqe {
+    __u32 buf;          // 缓冲区编号
+    __u32 len;          // 待传输的字节数
+    __u64 user_data;    // 原样返回到对应的CQE中
+};
+
+// 完成队列项
+struct mydma_cqe {
+    __u32 buf;          // 缓冲区编号
+    __u32 len;          // 完成的字节数
+    __s32 res;          // 0表示成功，否则为负的错误码
+    __u32 flags;
+    __u64 user_data;
+};
+
+struct mydma_uring_params {
+    __u32 sq_entries;       // 输入: 期望的SQ深度(0表示默认); 输出: 实际深度(2的幂)
+    __u32 cq_entries;       // 输出: CQ深度(2的幂)
+    __u32 region_size;      // 输出: 需要mmap的字节数
+    // 以下均为共享区域内的字节偏移 (输出)
+    __u32 sq_head_off;      // 内核写: 已消费的SQE位置
+    __u32 sq_tail_off;      // 用户写: 已生产的SQE位置
+    __u32 cq_head_off;      // 用户写: 已消费的CQE位置
+    __u32 cq_tail_off;      // 内核写: 已生产的CQE位置
+    __u32 cq_overflow_off;  // 内核写: 因CQ已满而未能投递的完成数
+    __u32 sqes_off;
+    __u32 cqes_off;
+    __u32 resv[2];
+};
+
+// URING_ENTER的参数，ioctl返回值为本次消费的SQE个数
+struct mydma_uring_enter {
+    __u32 to_submit;        // 最多消费多少个SQE
+    __u32 min_complete;     // 返回前至少等待CQ中有多少个未消费的CQE
+};
+
+#define MYDMA_IOC_URING_SETUP _IOWR(MYDMA_IOC_MAGIC, 0x05, struct mydma_uring_params)
+#define MYDMA_IOC_URING_ENTER _IOW(MYDMA_IOC_MAGIC, 0x06, struct mydma_uring_enter)
+
+// --- 批量提交 ---
+// 一次ioctl提交多个零拷贝缓冲区，只写一次尾指针寄存器；ioctl返回入队的个数。
+// 遇到非法项或环形缓冲区满时提前停止，之前的项照常提交。
+// 拷贝模式下也可以用writev()：每个iovec段对应一个描述符，返回入队的字节数。
+struct mydma_buf_batch {
+    __u64 reqs;             // 指向nr个struct mydma_buf_req的用户地址
+    __u32 nr;
+    __u32 resv;
+};
+
+#define MYDMA_IOC_SUBMIT_BATCH _IOW(MYDMA_IOC_MAGIC, 0x07, struct mydma_buf_batch)
+
+// --- 按文件设置的选项 ---
+struct mydma_opt {
+    __u32 opt;              // MYDMA_OPT_*
+    __u32 resv;
+    __u64 val;
+};
+
+// 直接模式：write()的长度不小于val字节时，驱动固定用户页并直接对其做DMA(就地操作)，
+// write()同步等待完成后才返回，结果已写回传入write()的缓冲区，无需再调用read()。0表示关闭(默认)。
+#define MYDMA_OPT_DIRECT_MIN    1
+// 带标签的异步读写：置1后，每次write()的数据前须带一个struct mydma_tag_hdr，标签不参与DMA；
+// 每次read()先返回一个struct mydma_completion，完成的数据紧随其后。此模式下不使用直接模式。
+// writev()时每个iovec段都须以标签头开头，段长不超过标签头加一个缓冲区大小。
+// 配合O_NONBLOCK和poll()/epoll(EPOLLIN: 有完成事件, EPOLLOUT: 可以再提交)，单线程即可保持大量在途操作
+#define MYDMA_OPT_TAGGED        2
+// 混合轮询：read()和MYDMA_IOC_COMPLETE睡眠前先自旋最多val微秒(不超过10000)，期间屏蔽该队列的中断，
+// 小消息的完成延迟不再包含中断、唤醒和调度。0表示关闭(默认)。O_NONBLOCK的read()不轮询
+#define MYDMA_OPT_POLL_USECS    3
+// 等待完成的超时毫秒数(不超过600000)，对read()、write()、MYDMA_IOC_COMPLETE、URING_ENTER等所有等待生效，超时返回-ETIMEDOUT。
+// 0表示自适应(默认)：按该队列测得的吞吐量和排在前面的在途描述符推算，小传输很快就能判定超时。
+// 看门狗复位设备时被中止的传输以-EIO结束(CQE和带标签完成事件中的res)
+#define MYDMA_OPT_TIMEOUT_MS    4
+// 优先级：置1后该文件改用为高优先级保留的队列(模块参数hiprio_queues)，它有自己的环形缓冲区、缓冲池分片和中断；
+// 设备支持时还按严格优先或加权轮询(模块参数hiprio_weight)先于普通队列取描述符，控制消息不再排在大块传输后面。
+// 须在该文件第一次write()、BUF_ALLOC或URING_SETUP之前设置，否则返回-EBUSY；设备没有保留的队列时返回-EOPNOTSUPP
+#define MYDMA_OPT_PRIORITY      5
+// 数据完整性：置1后驱动在把write()/writev()的数据拷贝进缓冲池的同时算出CRC32C，传输完成后与结果比较，
+// 设备支持时由设备在写结果时计算，否则在read()拷贝结果的同时由驱动计算，都不需要再单独遍历一遍数据。
+// 不一致时传输以-EBADMSG结束(带标签模式下在完成事件的res中，数据照常返回)。开启后write()不走直接模式和内联描述符
+#define MYDMA_OPT_CRC32C        6
+
+struct mydma_tag_hdr {
+    __u64 tag;              // 原样返回到对应的mydma_completion中
+};
+
+struct mydma_completion {
+    __u64 tag;
+    __u32 len;              // 完成的字节数 (不含本结构)
+    __s32 res;              // 0表示成功，否则为负的错误码
+};
+
+#define MYDMA_IOC_SET_OPT _IOW(MYDMA_IOC_MAGIC, 0x08, struct mydma_opt)
+#define MYDMA_IOC_GET_OPT _IOWR(MYDMA_IOC_MAGIC, 0x09, struct mydma_opt)
+
+// --- 异地传输 ---
+// 从缓冲区in_buf读取len字节，结果写入缓冲区out_buf，in_buf的内容保持不变。两个缓冲区都须已通过BUF_ALLOC申请且互不相同。
+// 用COMPLETE等待out_buf完成；传输期间in_buf同样不可再次提交，out_buf完成时in_buf重新归用户所有。
+struct mydma_oop_req {
+    __u32 in_buf;           // 输入缓冲区编号
+    __u32 out_buf;          // 输出缓冲区编号
+    __u32 len;              // 待传输的字节数
+    __u32 resv;
+};
+
+#define MYDMA_IOC_SUBMIT_OOP _IOW(MYDMA_IOC_MAGIC, 0x0a, struct mydma_oop_req)
+
+// --- dma-buf ---
+// BUF_EXPORT把一个已申请的缓冲区导出为dma-buf，ioctl返回新的文件描述符，可交给GPU、NIC等其他设备的驱动导入。
+// 导出期间缓冲区不能BUF_FREE；关闭/dev/mydmaN后，缓冲区保留到最后一个dma-buf引用释放为止。
+struct mydma_buf_export {
+    __u32 buf;              // 缓冲区编号
+    __u32 flags;            // 0或O_CLOEXEC
+};
+
+// DMABUF_XFER：一端或两端为外部dma-buf的传输，同步等待完成后返回0，数据不经过CPU。
+// fd >= 0时该端为该dma-buf中从off开始的len字节；fd < 0时该端为编号为buf的缓冲区(忽略off)，两端不能都是缓冲区。
+// 导出方支持时dma-buf可以位于对端PCIe设备的BAR中，数据经P2PDMA在设备之间直接传输
+struct mydma_dmabuf_xfer {
+    __s32 in_fd;
+    __s32 out_fd;
+    __u64 in_off;
+    __u64 out_off;
+    __u32 in_buf;
+    __u32 out_buf;
+    __u32 len;              // 待传输的字节数
+    __u32 resv;
+};
+
+#define MYDMA_IOC_BUF_EXPORT  _IOW(MYDMA_IOC_MAGIC, 0x0b, struct mydma_buf_export)
+#define MYDMA_IOC_DMABUF_XFER _IOW(MYDMA_IOC_MAGIC, 0x0c, struct mydma_dmabuf_xfer)
+
+#endif /* MYDMA_IOCTL_H */
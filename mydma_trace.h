@@ -0,0 +1,114 @@
+/*
+ * mydma_trace.h - mydma驱动的跟踪点
+ * 关闭时每个跟踪点只是一条被static key跳过的指令，可以在生产环境中按需打开：
+ *   echo 1 > /sys/kernel/tracing/events/mydma/enable
+ *   cat /sys/kernel/tracing/trace_pipe
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM mydma
+
+#if !defined(_MYDMA_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _MYDMA_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <linux/types.h>
+
+// 每填好一个硬件描述符触发一次
+TRACE_EVENT(mydma_submit,
+    TP_PROTO(u32 qid, u32 slot, dma_addr_t in_addr, dma_addr_t out_addr, u32 len, u32 flags),
+    TP_ARGS(qid, slot, in_addr, out_addr, len, flags),
+
+    TP_STRUCT__entry(
+        __field(u32, qid)
+        __field(u32, slot)
+        __field(dma_addr_t, in_addr)
+        __field(dma_addr_t, out_addr)
+        __field(u32, len)
+        __field(u32, flags)
+    ),
+
+    TP_fast_assign(
+        __entry->qid = qid;
+        __entry->slot = slot;
+        __entry->in_addr = in_addr;
+        __entry->out_addr = out_addr;
+        __entry->len = len;
+        __entry->flags = flags;
+    ),
+
+    TP_printk("q=%u slot=%u in=%pad out=%pad len=%u flags=0x%x",
+              __entry->qid, __entry->slot, &__entry->in_addr, &__entry->out_addr,
+              __entry->len, __entry->flags)
+);
+
+// 硬中断
+TRACE_EVENT(mydma_irq,
+    TP_PROTO(u32 qid),
+    TP_ARGS(qid),
+
+    TP_STRUCT__entry(
+        __field(u32, qid)
+    ),
+
+    TP_fast_assign(
+        __entry->qid = qid;
+    ),
+
+    TP_printk("q=%u", __entry->qid)
+);
+
+// 一次传输的全部描述符都已完成；slot为最后一个描述符，latency_ns从门铃写尾指针寄存器算起
+TRACE_EVENT(mydma_complete,
+    TP_PROTO(u32 qid, u32 slot, u32 len, u64 latency_ns),
+    TP_ARGS(qid, slot, len, latency_ns),
+
+    TP_STRUCT__entry(
+        __field(u32, qid)
+        __field(u32, slot)
+        __field(u32, len)
+        __field(u64, latency_ns)
+    ),
+
+    TP_fast_assign(
+        __entry->qid = qid;
+        __entry->slot = slot;
+        __entry->len = len;
+        __entry->latency_ns = latency_ns;
+    ),
+
+    TP_printk("q=%u slot=%u len=%u latency_ns=%llu",
+              __entry->qid, __entry->slot, __entry->len, __entry->latency_ns)
+);
+
+// 回收之后环形缓冲区仍放不下need个描述符，提交失败或需要等待
+TRACE_EVENT(mydma_ring_full,
+    TP_PROTO(u32 qid, u32 head, u32 tail, u32 need),
+    TP_ARGS(qid, head, tail, need),
+
+    TP_STRUCT__entry(
+        __field(u32, qid)
+        __field(u32, head)
+        __field(u32, tail)
+        __field(u32, need)
+    ),
+
+    TP_fast_assign(
+        __entry->qid = qid;
+        __entry->head = head;
+        __entry->tail = tail;
+        __entry->need = need;
+    ),
+
+    TP_printk("q=%u head=%u tail=%u need=%u",
+              __entry->qid, __entry->head, __entry->tail, __entry->need)
+);
+
+#endif /* _MYDMA_TRACE_H */
+
+// 跟踪点头文件不在标准路径下，Makefile中为mydma.o加了-I$(src)
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE mydma_trace
+#include <trace/define_trace.h>
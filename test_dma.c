@@ -15,7 +15,9 @@
 #define ANSI_COLOR_RED     "\x1b[31m" // For error/failure
 #define ANSI_COLOR_RESET   "\x1b[0m"  // Reset to default color
 
-int main() {
+int main(int argc, char *argv[]) {
+    // 多块卡时可以指定/dev/mydmaN，默认第一块
+    const char *path = argc > 1 ? argv[1] : DEVICE_PATH;
     int fd;
     ssize_t bytes_written, bytes_read;
     const char *write_buf = TEST_STRING;
@@ -28,8 +30,8 @@ int main() {
     }
 
     // 1. 打开设备
-    printf("Opening device: %s\n", DEVICE_PATH);
-    fd = open(DEVICE_PATH, O_RDWR);
+    printf("Opening device: %s\n", path);
+    fd = open(path, O_RDWR);
     if (fd < 0) {
         perror(ANSI_COLOR_RED "Failed to open device" ANSI_COLOR_RESET);
         free(read_buf);